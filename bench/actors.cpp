@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../lib/textfile.hpp"
+#include "../lib/parser.hpp"
+#include "../lib/interpreter.hpp"
+#include "../lib/vm.hpp"
+#include "../lib/actors.hpp"
+
+using namespace std;
+
+// Runs actor workloads on 1, 2, 4, ... worker threads in both engines and prints one JSON document.
+// Usage: bench-actors [max threads] [scale] [repetitions]
+
+struct Workload {
+    string name;
+    string source;
+    size_t messages;    // handled per run
+    string output;      // printed per run, if checked
+};
+
+// The language has no conditionals, so the workloads end their chains of messages with these:
+//   (dec n)           n - 1
+//   (choose n a b)    a while n > 0, b after
+template<typename Engine>
+void defineHelpers (Engine &engine) {
+    engine.define("dec", [](Deluxe::NativeContext &, Deluxe::Arguments args) {
+        return Deluxe::Value::fromNumber(args.empty() ? 0 : args[0].as.number - 1);
+    }, true);
+    engine.define("choose", [](Deluxe::NativeContext &, Deluxe::Arguments args) {
+        if (args.size() < 3) return Deluxe::Value::none();
+        return args[0].type == Deluxe::ValueType::NUMBER && args[0].as.number > 0 ? args[1] : args[2];
+    }, true);
+}
+
+vector<Workload> generate (uint scale) {
+    vector<Workload> workloads;
+
+    // Pairs of actors sending a counter back and forth; an exhausted counter turns into `done`, which nobody handles
+    uint pairs = 64;
+    uint rounds = 100 * scale;
+    string pingPong = "(let player (class (on ping other n (send (choose n ping done) other (self) (dec n)))))\n";
+    for (uint i = 0; i < pairs; i++) pingPong += "(send ping (player) (player) " + to_string(rounds) + ")\n";
+    workloads.push_back(Workload { "ping-pong", pingPong, (size_t)pairs * (rounds + 2), "" });
+
+    // A binary tree of actors, each spawning two children until the leaves, which format a few strings
+    uint depth = 10;
+    while ((1u << (depth + 1)) < 2048 * scale) depth++;
+    string fanOut = "(let node (class\n"
+        "  (on grow n (let child (choose n grow leaf)) (send child (node) (dec n)) (send child (node) (dec n)))\n"
+        "  (on leaf n (sprintf \"%d %s\" n (sprintf \"%.2f\" n) (sprintf \"leaf %d\" n)))))\n"
+        "(send grow (node) " + to_string(depth) + ")\n";
+    workloads.push_back(Workload { "fan-out", fanOut, ((size_t)1 << (depth + 2)) - 1, "" });
+
+    // Actors collecting what they are sent in a list and a map they close over, in batches that may run on different
+    // workers; each prints how much it collected, which is only all of it if both outlive every message
+    uint tallies = 16;
+    string state = "(let tally (class (let seen (list)) (let counts (map))\n"
+        "  (on add n (push seen n) (put counts n (length seen)) (send (choose n add report) (self) (dec n)))\n"
+        "  (on report n (printf \"%d %d\" (length seen) (length counts)))))\n";
+    string counts;
+    for (uint i = 0; i < tallies; i++) {
+        state += "(send add (tally) " + to_string(rounds) + ")\n";
+        counts += to_string(rounds + 1) + " " + to_string(rounds + 1) + "\n";
+    }
+    workloads.push_back(Workload { "state", state, (size_t)tallies * (rounds + 2), counts });
+
+    return workloads;
+}
+
+struct Measurement {
+    string engine;
+    string workload;
+    uint threads;
+    size_t messages;
+    vector<double> samples; // nanoseconds
+    size_t steals;
+    string output;          // of the last run
+};
+
+// Times the top level plus every message it causes, on a fresh engine and scheduler each time
+template<typename Engine>
+void run (Engine &engine, uint threads, Measurement &result) {
+    Deluxe::Scheduler scheduler(threads);
+    ostringstream output;
+    engine.context.scheduler = &scheduler;
+    engine.context.out = &output;
+    auto start = chrono::steady_clock::now();
+    engine.run();
+    scheduler.run(engine);
+    result.samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    result.steals += scheduler.stats.steals;
+    result.messages = scheduler.stats.messages;
+    result.output = output.str();
+}
+
+Measurement measure (const string &engine, const Workload &workload, uint threads, uint repetitions) {
+    Measurement result { engine, workload.name, threads, 0, {}, 0, "" };
+    auto file = make_shared<Deluxe::Textfile>(workload.source);
+    auto ast = Deluxe::Parser::parse(Deluxe::Parser::getTokens(file->getView()), file);
+    for (uint i = 0; i <= repetitions; i++) {
+        if (engine == "interpreter") {
+            Deluxe::Interpreter interpreter(ast);
+            defineHelpers(interpreter);
+            run(interpreter, threads, result);
+        } else {
+            Deluxe::VM vm;
+            defineHelpers(vm);
+            vm.load(ast);
+            run(vm, threads, result);
+        }
+        // The first run is a warm-up
+        if (i == 0) {
+            result.samples.clear();
+            result.steals = 0;
+        }
+    }
+    return result;
+}
+
+void print (ostream &out, const Measurement &m, double baseline) {
+    vector<double> sorted = m.samples;
+    sort(sorted.begin(), sorted.end());
+    double median = sorted.empty() ? 0 : sorted[sorted.size() / 2];
+    out << "    {\"engine\": \"" << m.engine << "\", \"workload\": \"" << m.workload << "\", \"threads\": " << m.threads
+        << ", \"messages\": " << m.messages << ", \"samples\": " << sorted.size() << fixed << setprecision(1)
+        << ", \"median_ms\": " << median / 1e6
+        << ", \"messages_per_second\": " << (median > 0 ? m.messages / (median / 1e9) : 0)
+        << setprecision(2) << ", \"speedup\": " << (median > 0 ? baseline / median : 0)
+        << setprecision(1) << ", \"steals_per_run\": " << (sorted.empty() ? 0 : m.steals / (double)sorted.size())
+        << "}";
+}
+
+int main (int argc, char **argv) {
+    uint maxThreads = max(1u, thread::hardware_concurrency());
+    uint scale = 10;
+    uint repetitions = 5;
+    if (argc > 1) maxThreads = std::stoul(argv[1]);
+    if (argc > 2) scale = std::stoul(argv[2]);
+    if (argc > 3) repetitions = std::stoul(argv[3]);
+
+    vector<uint> counts;
+    for (uint threads = 1; threads < maxThreads; threads *= 2) counts.push_back(threads);
+    counts.push_back(maxThreads);
+
+    vector<pair<Measurement, double>> results;
+    for (auto &workload : generate(scale)) {
+        for (string engine : { "vm", "interpreter" }) {
+            double baseline = 0;
+            for (uint threads : counts) {
+                auto result = measure(engine, workload, threads, repetitions);
+                if (result.messages != workload.messages) {
+                    cerr << workload.name << " on " << engine << " handled " << result.messages << " messages instead of "
+                         << workload.messages << endl;
+                    return 1;
+                }
+                if (!workload.output.empty() && result.output != workload.output) {
+                    cerr << workload.name << " on " << engine << " printed\n" << result.output << "instead of\n" << workload.output;
+                    return 1;
+                }
+                vector<double> sorted = result.samples;
+                sort(sorted.begin(), sorted.end());
+                if (threads == 1) baseline = sorted[sorted.size() / 2];
+                results.push_back(pair<Measurement, double>(result, baseline));
+            }
+        }
+    }
+
+    cout << "{" << endl;
+    cout << "  \"version\": 1," << endl;
+    cout << "  \"hardware_threads\": " << thread::hardware_concurrency() << "," << endl;
+    cout << "  \"scale\": " << scale << "," << endl;
+    cout << "  \"repetitions\": " << repetitions << "," << endl;
+    cout << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        print(cout, results[i].first, results[i].second);
+        cout << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    cout << "  ]" << endl;
+    cout << "}" << endl;
+    return 0;
+}
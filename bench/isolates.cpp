@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../lib/isolate.hpp"
+
+using namespace std;
+
+// Serves synthetic requests from 1, 2, 4, ... client threads through an IsolatePool and prints one JSON document,
+// standing in for a server that runs one script per request. Usage: bench-isolates [max threads] [requests per thread]
+
+struct Workload {
+    string name;
+    string source;
+    bool call;      // requests call `handle` with a number; otherwise each runs the whole script
+};
+
+vector<Workload> generate () {
+    vector<Workload> workloads;
+
+    // A handler formatting a small response through a few helper functions defined once per isolate
+    string handler =
+        "(let row (fn key value (sprintf \"<tr><td>%s</td><td>%.2f</td></tr>\" key value)))\n"
+        "(let table (fn id (sprintf \"<table>%s%s%s</table>\" (row \"id\" id) (row \"half\" id) (row \"twice\" id))))\n"
+        "(let handle (fn id (printf \"request %d: %s\" id (table id))))\n";
+    workloads.push_back(Workload { "call", handler, true });
+
+    // A whole script per request, defining its functions and printing a page
+    string script = handler;
+    for (uint i = 0; i < 20; i++) script += "(handle " + to_string(i) + ")\n";
+    workloads.push_back(Workload { "run", script, false });
+
+    return workloads;
+}
+
+struct Measurement {
+    string engine;
+    string workload;
+    uint threads;
+    size_t requests;
+    double seconds;
+    vector<double> latencies;   // nanoseconds
+    size_t isolates;
+    size_t bytes;               // of output
+};
+
+template<typename Engine>
+Measurement measure (const string &engine, const Workload &workload, shared_ptr<const Deluxe::Script> script, uint threads, size_t requests) {
+    Deluxe::IsolatePool<Engine> pool(script);
+    pool.warm(threads);
+    Measurement result { engine, workload.name, threads, requests * threads, 0, {}, 0, 0 };
+    vector<vector<double>> latencies(threads);
+    atomic<size_t> bytes(0);
+    atomic<bool> failed(false);
+    vector<thread> clients;
+    auto start = chrono::steady_clock::now();
+    for (uint t = 0; t < threads; t++) {
+        clients.emplace_back([&, t]() {
+            size_t written = 0;
+            for (size_t i = 0; i < requests; i++) {
+                auto begin = chrono::steady_clock::now();
+                auto response = workload.call ? pool.call("handle", { Deluxe::Portable::fromNumber(t * requests + i) }) : pool.run();
+                latencies[t].push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count());
+                if (response.failed) failed = true;
+                written += response.output.size();
+            }
+            bytes += written;
+        });
+    }
+    for (auto &client : clients) client.join();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (failed) {
+        cerr << workload.name << " on " << engine << " failed: " << pool.run().output << endl;
+        exit(1);
+    }
+    for (auto &samples : latencies) result.latencies.insert(result.latencies.end(), samples.begin(), samples.end());
+    result.isolates = pool.created;
+    result.bytes = bytes;
+    return result;
+}
+
+double percentile (const vector<double> &sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void print (ostream &out, const Measurement &m, double baseline) {
+    vector<double> sorted = m.latencies;
+    sort(sorted.begin(), sorted.end());
+    double throughput = m.seconds > 0 ? m.requests / m.seconds : 0;
+    out << "    {\"engine\": \"" << m.engine << "\", \"workload\": \"" << m.workload << "\", \"threads\": " << m.threads
+        << ", \"requests\": " << m.requests << ", \"isolates\": " << m.isolates << ", \"output_bytes\": " << m.bytes
+        << fixed << setprecision(1) << ", \"requests_per_second\": " << throughput
+        << setprecision(2) << ", \"speedup\": " << (baseline > 0 ? throughput / baseline : 0)
+        << setprecision(1) << ", \"p50_ns\": " << percentile(sorted, 0.5) << ", \"p99_ns\": " << percentile(sorted, 0.99)
+        << "}";
+}
+
+int main (int argc, char **argv) {
+    uint maxThreads = max(1u, thread::hardware_concurrency());
+    size_t requests = 20000;
+    if (argc > 1) maxThreads = std::stoul(argv[1]);
+    if (argc > 2) requests = std::stoull(argv[2]);
+
+    vector<uint> counts;
+    for (uint threads = 1; threads < maxThreads; threads *= 2) counts.push_back(threads);
+    counts.push_back(maxThreads);
+
+    vector<pair<Measurement, double>> results;
+    for (auto &workload : generate()) {
+        auto script = Deluxe::Script::compile(workload.source);
+        for (string engine : { "vm", "interpreter" }) {
+            double baseline = 0;
+            for (uint threads : counts) {
+                auto result = engine == "vm"
+                    ? measure<Deluxe::VM>(engine, workload, script, threads, requests)
+                    : measure<Deluxe::Interpreter>(engine, workload, script, threads, requests);
+                if (threads == 1) baseline = result.requests / result.seconds;
+                results.push_back(pair<Measurement, double>(result, baseline));
+            }
+        }
+    }
+
+    cout << "{" << endl;
+    cout << "  \"version\": 1," << endl;
+    cout << "  \"hardware_threads\": " << thread::hardware_concurrency() << "," << endl;
+    cout << "  \"requests_per_thread\": " << requests << "," << endl;
+    cout << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        print(cout, results[i].first, results[i].second);
+        cout << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    cout << "  ]" << endl;
+    cout << "}" << endl;
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../lib/textfile.hpp"
+#include "../lib/parser.hpp"
+
+using namespace std;
+
+const Deluxe::ScanLevel levels[] = { Deluxe::ScanLevel::SCALAR, Deluxe::ScanLevel::SSE2, Deluxe::ScanLevel::AVX2 };
+
+// Either the token stream or the exception message, so failing inputs are compared too
+string describe (string_view content, const Deluxe::Scanner *scanner) {
+    string result;
+    try {
+        auto tokens = scanner ? Deluxe::Parser::getTokens(content, *scanner) : Deluxe::Parser::getTokensScalar(content);
+        for (auto &token : tokens) {
+            result += to_string(token.tokenType) + ":" + to_string(token.content.data() - content.data()) + "+"
+                + to_string(token.content.size()) + "@" + to_string(token.line) + " ";
+        }
+    } catch (exception &e) {
+        result += string("throws ") + e.what();
+    }
+    return result;
+}
+
+// Random inputs biased towards the bytes the lexer branches on, checked against the byte-at-a-time lexer
+bool fuzz (uint iterations) {
+    const string alphabet = "()[]{}\";\n\n   \t\r\v\fab-z019..";
+    mt19937 random(1234);
+    for (uint i = 0; i < iterations; i++) {
+        string content;
+        uint length = random() % 300;
+        for (uint c = 0; c < length; c++) {
+            uint pick = random() % 64;
+            if (pick < alphabet.size()) content.push_back(alphabet[pick]);
+            else if (pick < 60) content.push_back('a' + random() % 26);
+            else content.push_back((char)(random() % 256));
+        }
+        string expected = describe(content, nullptr);
+        for (auto level : levels) {
+            if (!Deluxe::Scanner::isSupported(level)) continue;
+            Deluxe::Scanner scanner(level);
+            if (describe(content, &scanner) == expected) continue;
+            cout << "FAIL: " << Deluxe::Scanner::getLevelName(level) << " lexer differs from scalar lexer on input:" << endl << content << endl;
+            return false;
+        }
+    }
+    cout << "OK: " << iterations << " random inputs lex identically at every scan level" << endl;
+    return true;
+}
+
+string generate (size_t size) {
+    string content;
+    content.reserve(size + 256);
+    uint i = 0;
+    while (content.size() < size) {
+        string id = to_string(i++);
+        content += "(module bundle-" + id + "\n";
+        content += "    (let value-" + id + " {fn alpha beta (printf \"value " + id + " is a fairly long string literal: \" (return alpha [list beta 1.5 " + id + "]))})\n";
+        content += "    ; a comment line describing the form number " + id + "\n";
+        content += "    (printf (value-" + id + " \"first argument\" 12345.678))\n)\n";
+    }
+    return content;
+}
+
+int main (int argc, char **argv) {
+    size_t size = 64 * 1024 * 1024;
+    if (argc > 1) size = std::stoull(argv[1]);
+    if (!fuzz(20000)) return 1;
+
+    string content = generate(size);
+    cout << setw(10) << "level" << setw(12) << "MB/s" << setw(12) << "tokens" << endl;
+    for (auto level : levels) {
+        if (!Deluxe::Scanner::isSupported(level)) continue;
+        Deluxe::Scanner scanner(level);
+        double best = 0;
+        size_t count = 0;
+        for (uint run = 0; run < 3; run++) {
+            auto start = chrono::steady_clock::now();
+            auto tokens = level == Deluxe::ScanLevel::SCALAR
+                ? Deluxe::Parser::getTokensScalar(content)
+                : Deluxe::Parser::getTokens(content, scanner);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            count = tokens.size();
+            double throughput = content.size() / seconds / (1024 * 1024);
+            if (throughput > best) best = throughput;
+        }
+        cout << setw(10) << Deluxe::Scanner::getLevelName(level) << setw(12) << fixed << setprecision(1) << best << setw(12) << count
+             << (level == Deluxe::Scanner::get().level ? "   (default)" : "") << endl;
+    }
+    return 0;
+}
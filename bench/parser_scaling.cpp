@@ -0,0 +1,53 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "../lib/textfile.hpp"
+#include "../lib/parser.hpp"
+
+using namespace std;
+
+// Builds a script of roughly `size` bytes out of nested, flat and string-heavy forms
+string generate (size_t size) {
+    string content;
+    content.reserve(size + 128);
+    uint i = 0;
+    while (content.size() < size) {
+        string id = to_string(i++);
+        content += "(let value-" + id + " {fn a b (printf \"value " + id + ": \" (return a [list b 1.5 " + id + "]))})\n";
+        content += "; comment line " + id + "\n";
+    }
+    return content;
+}
+
+int main (int argc, char **argv) {
+    size_t maxSize = 100 * 1024 * 1024;
+    if (argc > 1) maxSize = std::stoull(argv[1]);
+
+    cout << setw(12) << "bytes" << setw(12) << "tokens" << setw(12) << "forms" << setw(12) << "ms" << setw(12) << "ns/byte" << endl;
+    double fastest = 0;
+    double slowest = 0;
+    for (size_t size = 1024; size <= maxSize; size *= 10) {
+        auto file = make_shared<Deluxe::Textfile>(generate(size));
+        auto start = chrono::steady_clock::now();
+        auto tokens = Deluxe::Parser::getTokens(file->getView());
+        auto ast = Deluxe::Parser::parse(tokens, file);
+        auto elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        double perByte = elapsed / file->length;
+        cout << setw(12) << file->length << setw(12) << tokens.size() << setw(12) << ast.expressions.size()
+             << setw(12) << fixed << setprecision(2) << elapsed / 1e6 << setw(12) << perByte << endl;
+        // Small inputs are dominated by cache and allocator warm-up; judge scaling from 100 KB up
+        if (file->length < 100 * 1024) continue;
+        if (fastest == 0 || perByte < fastest) fastest = perByte;
+        if (perByte > slowest) slowest = perByte;
+    }
+
+    if (fastest > 0 && slowest > fastest * 4) {
+        cout << "FAIL: cost per byte grew " << slowest / fastest << "x across input sizes" << endl;
+        return 1;
+    }
+    cout << "OK: cost per byte stays within " << (fastest > 0 ? slowest / fastest : 1.0) << "x across input sizes" << endl;
+    return 0;
+}
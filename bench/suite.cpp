@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../lib/allocations.hpp"
+#include "../lib/textfile.hpp"
+#include "../lib/parser.hpp"
+#include "../lib/interpreter.hpp"
+
+using namespace std;
+
+// Benchmarks the lexer, the parser and the tree-walking interpreter on synthetic workloads and prints one JSON
+// document, so runs of different versions can be diffed. Usage: bench [bytes per workload] [repetitions]
+
+struct Workload {
+    string name;
+    string source;
+};
+
+struct Measurement {
+    string stage;
+    string workload;
+    string unit;            // what one sample times: the whole input or a single top-level form
+    size_t bytes;
+    vector<double> samples; // nanoseconds
+    size_t allocations;
+};
+
+string fill (size_t size, const std::function<string(uint)> &form) {
+    string content;
+    content.reserve(size + 1024);
+    for (uint i = 0; content.size() < size; i++) content += form(i);
+    return content;
+}
+
+vector<Workload> generate (size_t size) {
+    vector<Workload> workloads;
+
+    // Forms nested 100 levels deep
+    workloads.push_back(Workload { "deep", fill(size, [](uint i) {
+        string form;
+        for (uint d = 0; d < 100; d++) form += d % 2 ? "[return " : "(return ";
+        form += to_string(i);
+        for (uint d = 100; d > 0; d--) form += (d - 1) % 2 ? "]" : ")";
+        return form + "\n";
+    }) });
+
+    // Long flat argument lists of numbers and symbols
+    workloads.push_back(Workload { "flat", fill(size, [](uint i) {
+        string form = "(return";
+        for (uint a = 0; a < 200; a++) form += a % 2 ? " value-" + to_string(a) : " " + to_string(i + a) + ".5";
+        return form + ")\n";
+    }) });
+
+    // String literals of varying length
+    workloads.push_back(Workload { "strings", fill(size, [](uint i) {
+        string form = "(printf";
+        for (uint a = 0; a < 8; a++) form += " \"string literal " + to_string(i) + string(a * 8, '-') + "\"";
+        return form + ")\n";
+    }) });
+
+    // A chain of small functions, then many calls into the top of it
+    string calls = "(let f0 (fn a (return a)))\n";
+    for (uint f = 1; f < 10; f++) {
+        calls += "(let f" + to_string(f) + " (fn a b (let c (f" + to_string(f - 1) + " a)) (return b c)))\n";
+    }
+    workloads.push_back(Workload { "calls", calls + fill(size, [](uint i) {
+        return "(f9 " + to_string(i) + " (f5 " + to_string(i) + " 2))\n";
+    }) });
+
+    // Lists and maps built, looked up and walked
+    string collections = "(let table (map (pair a 1) (pair b 2) (pair \"c\" 3)))\n(let row (fn x (list x x x x)))\n";
+    workloads.push_back(Workload { "collections", collections + fill(size, [](uint i) {
+        return "(get (row " + to_string(i) + ") 2) (get table b) (get table \"c\") (length (transform (range 16) row))\n";
+    }) });
+
+    return workloads;
+}
+
+// Times `body` `repetitions` times over the whole input
+template<typename Body>
+Measurement measure (const string &stage, const Workload &workload, uint repetitions, Body body) {
+    Measurement result { stage, workload.name, "input", workload.source.size(), {}, 0 };
+    body();  // warm-up
+    size_t allocations = Deluxe::Allocations::count();
+    for (uint run = 0; run < repetitions; run++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        result.samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    }
+    result.allocations = Deluxe::Allocations::count() - allocations;
+    return result;
+}
+
+// Times Interpreter::executeExpression once per top-level form, after a warm-up run has bound everything
+Measurement measureExecution (const Workload &workload, uint repetitions) {
+    Measurement result { "execute", workload.name, "form", workload.source.size(), {}, 0 };
+    auto file = make_shared<Deluxe::Textfile>(workload.source);
+    auto ast = Deluxe::Parser::parse(Deluxe::Parser::getTokens(file->getView()), file);
+    ostream discard(nullptr);
+    Deluxe::Interpreter interpreter(ast.symbols);
+    interpreter.context.out = &discard;
+    interpreter.execute(ast);
+    size_t allocations = Deluxe::Allocations::count();
+    for (uint run = 0; run < repetitions; run++) {
+        for (auto &exp : ast.expressions) {
+            auto start = chrono::steady_clock::now();
+            interpreter.executeExpression(exp);
+            result.samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+        }
+    }
+    result.allocations = Deluxe::Allocations::count() - allocations;
+    return result;
+}
+
+double percentile (const vector<double> &sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void print (ostream &out, const Measurement &m, uint repetitions) {
+    vector<double> sorted = m.samples;
+    sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (double sample : sorted) total += sample;
+    double seconds = total / 1e9;
+    out << "    {\"stage\": \"" << m.stage << "\", \"workload\": \"" << m.workload << "\", \"unit\": \"" << m.unit << "\""
+        << ", \"bytes\": " << m.bytes << ", \"samples\": " << sorted.size() << fixed << setprecision(1)
+        << ", \"mb_per_second\": " << (seconds > 0 ? m.bytes * (double)repetitions / seconds / (1024 * 1024) : 0)
+        << ", \"samples_per_second\": " << (seconds > 0 ? sorted.size() / seconds : 0)
+        << ", \"p50_ns\": " << percentile(sorted, 0.5) << ", \"p90_ns\": " << percentile(sorted, 0.9)
+        << ", \"p99_ns\": " << percentile(sorted, 0.99) << ", \"max_ns\": " << (sorted.empty() ? 0 : sorted.back())
+        << setprecision(3) << ", \"allocations_per_sample\": " << (sorted.empty() ? 0 : m.allocations / (double)sorted.size())
+        << "}";
+}
+
+int main (int argc, char **argv) {
+    size_t size = 1024 * 1024;
+    uint repetitions = 20;
+    if (argc > 1) size = std::stoull(argv[1]);
+    if (argc > 2) repetitions = std::stoul(argv[2]);
+
+    vector<Measurement> results;
+    for (auto &workload : generate(size)) {
+        string_view view(workload.source);
+        results.push_back(measure("lex", workload, repetitions, [&]() {
+            Deluxe::Parser::getTokens(view);
+        }));
+        auto tokens = Deluxe::Parser::getTokens(view);
+        results.push_back(measure("parse", workload, repetitions, [&]() {
+            Deluxe::Parser::parse(tokens);
+        }));
+        results.push_back(measureExecution(workload, 1));
+    }
+
+    cout << "{" << endl;
+    cout << "  \"version\": 1," << endl;
+    cout << "  \"scanner\": \"" << Deluxe::Scanner::getLevelName(Deluxe::Scanner::get().level) << "\"," << endl;
+    cout << "  \"bytes_per_workload\": " << size << "," << endl;
+    cout << "  \"repetitions\": " << repetitions << "," << endl;
+    cout << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        print(cout, results[i], results[i].unit == "form" ? 1 : repetitions);
+        cout << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    cout << "  ]" << endl;
+    cout << "}" << endl;
+    return 0;
+}
@@ -0,0 +1,568 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "value.hpp"
+#include "heap.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    class ActorException : public exception {
+        public:
+            string message;
+
+            ActorException (string message) {
+                this->message = string("Actor Exception: " + message);
+            }
+
+            const char * what () const throw () {
+                return this->message.c_str();
+            }
+    };
+
+    struct PortableFunction;
+
+    // A value copied out of one engine's heap, so an engine on another thread can rebuild it in its own.
+    // Functions keep pointing at their code and carry copies of their captures. Collections are copied with
+    // their contents; one reached again within the same value, e.g. a list containing itself, is copied once
+    // and referred to by the order in which it was first reached.
+    struct Portable {
+        ValueType type;
+        double number;
+        string text;
+        shared_ptr<const PortableFunction> function;
+        Actor *actor;
+        vector<Portable> items;     // of a list, or the keys and values of a map in turn
+        uint reference;             // of a collection reached before: 1 + its number, otherwise 0
+
+        static Portable fromNumber (double number) { return Portable { ValueType::NUMBER, number, "", nullptr, nullptr, {}, 0 }; }
+        static Portable fromString (const string &text) { return Portable { ValueType::STRING, 0, text, nullptr, nullptr, {}, 0 }; }
+
+        static Portable from (const Value &value) {
+            unordered_map<const Object*, uint> seen;
+            return Portable::copy(value, seen, 0);
+        }
+
+        static Portable copy (const Value &value, unordered_map<const Object*, uint> &seen, uint depth);
+
+        // Copies several values as one, so collections they share are still shared when rebuilt with materializeAll
+        static vector<Portable> fromAll (const vector<Value> &values) {
+            unordered_map<const Object*, uint> seen;
+            vector<Portable> result;
+            for (auto &value : values) result.push_back(Portable::copy(value, seen, 0));
+            return result;
+        }
+
+        static vector<Value> materializeAll (const vector<Portable> &values, Heap &heap) {
+            vector<Value> made;
+            vector<Value> result;
+            for (auto &value : values) result.push_back(value.materialize(heap, made));
+            return result;
+        }
+
+        Value materialize (Heap &heap) const {
+            vector<Value> made;
+            return this->materialize(heap, made);
+        }
+
+        Value materialize (Heap &heap, vector<Value> &made) const;
+
+        // Calls `visit` with every function in the value
+        template<typename Visit>
+        void eachFunction (Visit &visit) const;
+
+        // Calls `visit` with every actor in the value
+        template<typename Visit>
+        void eachActor (Visit &visit) const;
+    };
+
+    struct PortableFunction {
+        uint arity;
+        uint frameSize;
+        ExpressionList body;
+        shared_ptr<Arena> arena;
+        uint prototype;
+        uint line;
+        vector<Portable> captures;
+    };
+
+    inline Portable Portable::copy (const Value &value, unordered_map<const Object*, uint> &seen, uint depth) {
+        if (depth > 1000) throw ActorException("Cannot copy values nested this deep");
+        Portable result { value.type, 0, "", nullptr, nullptr, {}, 0 };
+        switch (value.type) {
+            case ValueType::NUMBER: result.number = value.as.number; break;
+            case ValueType::STRING:
+            case ValueType::SYMBOL: result.text = value.asString(); break;
+            case ValueType::ACTOR: result.actor = value.as.actor; break;
+            case ValueType::FUNCTION: {
+                auto source = value.asFunction();
+                auto function = make_shared<PortableFunction>(PortableFunction {
+                    source->arity, source->frameSize, source->body, source->arena, source->prototype, source->line, {}
+                });
+                for (auto &capture : source->captures) function->captures.push_back(Portable::copy(capture, seen, depth + 1));
+                result.function = function;
+                break;
+            }
+            case ValueType::LIST:
+            case ValueType::MAP: {
+                auto found = seen.find(value.as.object);
+                if (found != seen.end()) {
+                    result.reference = found->second + 1;
+                    break;
+                }
+                seen.insert(pair<const Object*, uint>(value.as.object, seen.size()));
+                if (value.type == ValueType::LIST) {
+                    for (auto &item : value.asList()->items) result.items.push_back(Portable::copy(item, seen, depth + 1));
+                    break;
+                }
+                for (auto &entry : value.asMap()->entries) {
+                    result.items.push_back(Portable::copy(entry.key, seen, depth + 1));
+                    result.items.push_back(Portable::copy(entry.value, seen, depth + 1));
+                }
+                break;
+            }
+            default: break;
+        }
+        return result;
+    }
+
+    template<typename Visit>
+    void Portable::eachFunction (Visit &visit) const {
+        if (this->function != nullptr) {
+            visit(*this->function);
+            for (auto &capture : this->function->captures) capture.eachFunction(visit);
+        }
+        for (auto &item : this->items) item.eachFunction(visit);
+    }
+
+    template<typename Visit>
+    void Portable::eachActor (Visit &visit) const {
+        if (this->actor != nullptr) visit(this->actor);
+        if (this->function != nullptr) {
+            for (auto &capture : this->function->captures) capture.eachActor(visit);
+        }
+        for (auto &item : this->items) item.eachActor(visit);
+    }
+
+    // `made` holds the collections rebuilt so far, in the order they were copied
+    inline Value Portable::materialize (Heap &heap, vector<Value> &made) const {
+        switch (this->type) {
+            case ValueType::NUMBER: return Value::fromNumber(this->number);
+            case ValueType::STRING: return heap.makeString(this->text);
+            case ValueType::SYMBOL: return heap.makeSymbol(this->text);
+            case ValueType::ACTOR: return Value::fromActor(this->actor);
+            case ValueType::FUNCTION: {
+                auto &source = *this->function;
+                auto function = heap.makeFunction(source.arity, source.frameSize, source.body, source.arena);
+                function->prototype = source.prototype;
+                function->line = source.line;
+                for (auto &capture : source.captures) function->captures.push_back(capture.materialize(heap, made));
+                return Value::fromObject(function);
+            }
+            case ValueType::LIST: {
+                if (this->reference > 0) return made[this->reference - 1];
+                Value list = heap.makeList(this->items.size());
+                made.push_back(list);
+                for (auto &item : this->items) list.asList()->items.push_back(item.materialize(heap, made));
+                return list;
+            }
+            case ValueType::MAP: {
+                if (this->reference > 0) return made[this->reference - 1];
+                Value map = heap.makeMap(this->items.size() / 2);
+                made.push_back(map);
+                for (size_t i = 0; i + 1 < this->items.size(); i += 2) {
+                    Value key = this->items[i].materialize(heap, made);
+                    map.asMap()->put(key, this->items[i + 1].materialize(heap, made));
+                }
+                heap.update(map.asMap());
+                return map;
+            }
+            case ValueType::UNBOUND: return Value::unbound();
+            default: return Value::none();
+        }
+    }
+
+    struct Message {
+        string name;
+        vector<Portable> args;
+    };
+
+    // An object made by a `class` constructor: its handlers and its mailbox. At most one worker runs an
+    // actor at a time, so handlers never race on the actor and script code needs no locks.
+    // The handlers are copied together, so the lists and maps they close over are the actor's state. The first
+    // worker to run the actor rebuilds them in its heap and keeps them there, changes included, until another
+    // worker steals the actor or the run ends; only then are they copied back.
+    class Actor {
+        public:
+            vector<string> messages;    // handled message names, matching `handlers`
+            vector<Portable> handlers;  // the state while no worker owns the actor
+            mutex lock;
+            deque<Message> mailbox;
+            bool scheduled;             // queued on a worker or being run; guarded by `lock`
+            int owner;                  // worker whose heap holds the state, or -1; written under `lock`
+            size_t slot;                // of the state among the owner's, see Scheduler::Worker
+
+            Actor () {
+                this->scheduled = false;
+                this->owner = -1;
+                this->slot = 0;
+            }
+    };
+
+    struct ActorStats {
+        size_t actors;
+        size_t messages;
+        size_t steals;
+        uint threads;
+    };
+
+    // Delivers messages to actors on a pool of worker threads. Each worker owns a deque of actors with
+    // mail: it takes work from the back of its own and, when that is empty, steals from the front of
+    // another's. Every worker runs handlers in its own engine, forked from the one that ran the top level,
+    // with a private heap; values travel between them as Portable copies. An actor whose state lives in the
+    // victim's heap is not taken directly: the victim copies the state out between batches and hands it over.
+    // Messages sent by the top level are delivered when run() is called after it, which returns once every
+    // mailbox is empty. Output of one handler call is written as one block.
+    class Scheduler {
+        public:
+            struct Worker {
+                mutex lock;
+                deque<Actor*> runnable;
+                vector<pair<Actor*, uint>> stolen;  // owned actors other workers took, with their index
+                vector<Actor*> owned;   // by slot; their states are pinned in this worker's heap from `base`
+                size_t base;
+            };
+
+            uint threads;           // workers per run, 0 for one per core
+            uint batch;             // messages handled before an actor goes back in line
+            ostream *out;
+            vector<unique_ptr<Actor>> actors;
+            mutex actorsLock;
+            vector<unique_ptr<Worker>> workers;
+            deque<Actor*> injected; // given mail from outside the workers, i.e. by the top level
+            mutex injectedLock;
+            atomic<size_t> pending; // messages sent but not handled yet
+            atomic<size_t> delivered;
+            atomic<size_t> steals;
+            mutex idleLock;
+            condition_variable idle;
+            mutex outputLock;
+            ActorStats stats;
+
+            inline static thread_local int current = -1;        // worker index of this thread
+            inline static thread_local Actor *self = nullptr;   // actor whose handler this thread is running
+
+            Scheduler (uint threads = 0) {
+                this->threads = threads;
+                this->batch = 64;
+                this->out = &cout;
+                this->pending = 0;
+                this->delivered = 0;
+                this->steals = 0;
+                this->stats = ActorStats { 0, 0, 0, 0 };
+            }
+
+            // (actor "message" handler ...): a new actor; handlers are called with the arguments of the message
+            Value spawn (Arguments args) {
+                if (args.size() % 2 != 0) throw ActorException("Handlers come in pairs of message name and function");
+                auto actor = make_unique<Actor>();
+                vector<Value> handlers;
+                for (size_t i = 0; i < args.size(); i += 2) {
+                    if (args[i].type != ValueType::STRING && args[i].type != ValueType::SYMBOL) throw ActorException("Message name expected");
+                    if (!args[i + 1].isFunction()) throw ActorException("Handler for " + args[i].asString() + " is not a function");
+                    actor->messages.push_back(args[i].asString());
+                    handlers.push_back(args[i + 1]);
+                }
+                actor->handlers = Portable::fromAll(handlers);
+                Actor *result = actor.get();
+                lock_guard<mutex> guard(this->actorsLock);
+                this->actors.push_back(move(actor));
+                return Value::fromActor(result);
+            }
+
+            // (send message actor args...): queues the message; actors ignore messages they have no handler for
+            void send (Arguments args) {
+                if (args.size() < 2 || (args[0].type != ValueType::STRING && args[0].type != ValueType::SYMBOL)) {
+                    throw ActorException("send needs a message name and an actor");
+                }
+                if (args[1].type != ValueType::ACTOR) throw ActorException("Cannot send " + args[0].asString() + " to something that is not an actor");
+                Actor *actor = args[1].as.actor;
+                Message message { args[0].asString(), {} };
+                for (size_t i = 2; i < args.size(); i++) message.args.push_back(Portable::from(args[i]));
+                this->pending++;
+                bool wake;
+                {
+                    lock_guard<mutex> guard(actor->lock);
+                    actor->mailbox.push_back(move(message));
+                    wake = !actor->scheduled;
+                    actor->scheduled = true;
+                }
+                if (wake) this->schedule(actor);
+            }
+
+            // Drops any mail left undelivered, e.g. by an error in the top level. Only between runs.
+            void discard () {
+                lock_guard<mutex> guard(this->actorsLock);
+                for (auto &actor : this->actors) {
+                    actor->mailbox.clear();
+                    actor->scheduled = false;
+                }
+                this->injected.clear();
+                this->pending = 0;
+            }
+
+            // Drops undelivered mail and the actors that `roots` do not reach, directly or through the handlers of
+            // actors they reach. Only between runs, with the roots of every engine that may still use an actor,
+            // e.g. the actors a collection of its heap reached.
+            void release (const unordered_set<Actor*> &roots) {
+                this->discard();
+                lock_guard<mutex> guard(this->actorsLock);
+                unordered_set<Actor*> reached;
+                vector<Actor*> pending(roots.begin(), roots.end());
+                auto reach = [&](Actor *actor) {
+                    if (reached.insert(actor).second) pending.push_back(actor);
+                };
+                for (auto actor : roots) reached.insert(actor);
+                while (!pending.empty()) {
+                    Actor *actor = pending.back();
+                    pending.pop_back();
+                    for (auto &handler : actor->handlers) handler.eachActor(reach);
+                }
+                auto dropped = remove_if(this->actors.begin(), this->actors.end(), [&](const unique_ptr<Actor> &actor) {
+                    return reached.count(actor.get()) == 0;
+                });
+                this->actors.erase(dropped, this->actors.end());
+            }
+
+            // Calls `visit` with every function the actors hold, as handlers or in undelivered mail; only while
+            // no worker runs
+            template<typename Visit>
+            void eachFunction (Visit visit) {
+                lock_guard<mutex> guard(this->actorsLock);
+                for (auto &actor : this->actors) {
+                    lock_guard<mutex> actorGuard(actor->lock);
+                    for (auto &handler : actor->handlers) handler.eachFunction(visit);
+                    for (auto &message : actor->mailbox) {
+                        for (auto &arg : message.args) arg.eachFunction(visit);
+                    }
+                }
+            }
+
+            void schedule (Actor *actor) {
+                if (Scheduler::current >= 0) {
+                    int owner;
+                    {
+                        lock_guard<mutex> guard(actor->lock);
+                        owner = actor->owner;
+                    }
+                    auto &worker = *this->workers[owner >= 0 ? owner : Scheduler::current];
+                    lock_guard<mutex> guard(worker.lock);
+                    worker.runnable.push_back(actor);
+                } else {
+                    lock_guard<mutex> guard(this->injectedLock);
+                    this->injected.push_back(actor);
+                }
+                this->idle.notify_one();
+            }
+
+            // Delivers every pending message using engines forked from `main`, which must not run meanwhile
+            template<typename Engine>
+            void run (Engine &main) {
+                if (this->pending == 0) return;
+                this->out = main.context.out;
+                vector<Portable> globals;
+                for (auto &value : main.globals) globals.push_back(Portable::from(value));
+                uint count = this->threads > 0 ? this->threads : max(1u, thread::hardware_concurrency());
+                this->workers.clear();
+                for (uint i = 0; i < count; i++) this->workers.push_back(make_unique<Worker>());
+                // Workers take their own work from the back, so this keeps the order the top level sent in
+                for (size_t i = 0; i < this->injected.size(); i++) {
+                    this->workers[i % count]->runnable.push_front(this->injected[i]);
+                }
+                this->injected.clear();
+                vector<thread> pool;
+                for (uint i = 0; i < count; i++) {
+                    pool.emplace_back([this, &main, &globals, i]() { this->work(main, globals, i); });
+                }
+                for (auto &worker : pool) worker.join();
+                this->workers.clear();
+                this->stats = ActorStats { this->actors.size(), this->delivered, this->steals, max(this->stats.threads, count) };
+            }
+
+            template<typename Engine>
+            void work (Engine &main, const vector<Portable> &globals, uint index) {
+                Scheduler::current = index;
+                auto engine = main.fork(globals);
+                ostringstream output;
+                engine->context.out = &output;
+                auto &own = *this->workers[index];
+                Pinned states(engine->heap);
+                own.base = states.mark;
+                while (this->pending > 0) {
+                    this->handOver(*engine, output, index);
+                    Actor *actor = this->take(index);
+                    if (actor == nullptr) {
+                        unique_lock<mutex> lock(this->idleLock);
+                        if (this->pending > 0) this->idle.wait_for(lock, chrono::milliseconds(1));
+                        continue;
+                    }
+                    this->process(*engine, output, actor);
+                }
+                // The engine ends with the run, so every state goes back to its actor
+                while (!own.owned.empty()) this->evict(*engine, output, own.owned.back());
+                Scheduler::current = -1;
+            }
+
+            // Copies the state of each owned actor another worker stole out of this worker's heap, and gives
+            // the actor to the thief
+            template<typename Engine>
+            void handOver (Engine &engine, ostringstream &output, uint index) {
+                vector<pair<Actor*, uint>> stolen;
+                {
+                    auto &own = *this->workers[index];
+                    lock_guard<mutex> guard(own.lock);
+                    if (own.stolen.empty()) return;
+                    swap(stolen, own.stolen);
+                }
+                for (auto &[actor, thief] : stolen) {
+                    this->evict(engine, output, actor);
+                    auto &worker = *this->workers[thief];
+                    lock_guard<mutex> guard(worker.lock);
+                    worker.runnable.push_back(actor);
+                    this->steals++;
+                }
+                this->idle.notify_all();
+            }
+
+            // Copies an owned actor's state out of this worker's heap. Only between batches, when the states
+            // are the last values pinned.
+            template<typename Engine>
+            void evict (Engine &engine, ostringstream &output, Actor *actor) {
+                auto &own = *this->workers[Scheduler::current];
+                auto &pinned = engine.heap.pinned;
+                try {
+                    actor->handlers = Portable::fromAll(pinned[own.base + actor->slot].asList()->items);
+                } catch (exception &e) {
+                    // The state the actor was last copied with is kept
+                    output << "Error: " << e.what() << "\n";
+                    this->flush(output);
+                }
+                Actor *last = own.owned.back();
+                own.owned[actor->slot] = last;
+                pinned[own.base + actor->slot] = pinned.back();
+                last->slot = actor->slot;
+                own.owned.pop_back();
+                pinned.pop_back();
+                lock_guard<mutex> guard(actor->lock);
+                actor->owner = -1;
+            }
+
+            Actor *take (uint index) {
+                {
+                    auto &own = *this->workers[index];
+                    lock_guard<mutex> guard(own.lock);
+                    if (!own.runnable.empty()) {
+                        Actor *actor = own.runnable.back();
+                        own.runnable.pop_back();
+                        return actor;
+                    }
+                }
+                for (size_t i = 1; i < this->workers.size(); i++) {
+                    int other = (index + i) % this->workers.size();
+                    auto &victim = *this->workers[other];
+                    lock_guard<mutex> guard(victim.lock);
+                    if (victim.runnable.empty()) continue;
+                    Actor *actor = victim.runnable.front();
+                    victim.runnable.pop_front();
+                    bool owned;
+                    {
+                        lock_guard<mutex> actorGuard(actor->lock);
+                        owned = actor->owner == other;
+                    }
+                    if (owned) {
+                        // Arrives in this worker's deque once the victim has copied its state out
+                        victim.stolen.push_back({ actor, index });
+                        continue;
+                    }
+                    this->steals++;
+                    return actor;
+                }
+                return nullptr;
+            }
+
+            // Handles up to `batch` messages, then puts the actor at the front of this worker's deque if it
+            // still has mail, behind the actors already waiting there and first in line for thieves.
+            // An actor run here for the first time has its state rebuilt in this worker's heap, where it stays.
+            template<typename Engine>
+            void process (Engine &engine, ostringstream &output, Actor *actor) {
+                auto &own = *this->workers[Scheduler::current];
+                if (actor->owner != Scheduler::current) {
+                    Value state = engine.heap.makeList(actor->handlers.size());
+                    state.asList()->items = Portable::materializeAll(actor->handlers, engine.heap);
+                    engine.heap.update(state.asList());
+                    actor->slot = own.owned.size();
+                    own.owned.push_back(actor);
+                    engine.heap.pinned.push_back(state);
+                    lock_guard<mutex> guard(actor->lock);
+                    actor->owner = Scheduler::current;
+                }
+                ListObject *handlers = engine.heap.pinned[own.base + actor->slot].asList();
+                for (uint n = 0; n < this->batch; n++) {
+                    Message message;
+                    {
+                        lock_guard<mutex> guard(actor->lock);
+                        if (actor->mailbox.empty()) break;
+                        message = move(actor->mailbox.front());
+                        actor->mailbox.pop_front();
+                    }
+                    Scheduler::self = actor;
+                    this->deliver(engine, output, *actor, handlers->items, message);
+                    Scheduler::self = nullptr;
+                    this->delivered++;
+                    if (--this->pending == 0) this->idle.notify_all();
+                }
+                {
+                    lock_guard<mutex> guard(actor->lock);
+                    if (actor->mailbox.empty()) {
+                        actor->scheduled = false;
+                        return;
+                    }
+                }
+                lock_guard<mutex> guard(own.lock);
+                own.runnable.push_front(actor);
+            }
+
+            template<typename Engine>
+            void deliver (Engine &engine, ostringstream &output, Actor &actor, const vector<Value> &handlers, const Message &message) {
+                auto found = find(actor.messages.begin(), actor.messages.end(), message.name);
+                if (found == actor.messages.end()) return;
+                vector<Value> args;
+                for (auto &arg : message.args) args.push_back(arg.materialize(engine.heap));
+                try {
+                    engine.invoke(handlers[found - actor.messages.begin()], Arguments { args.data(), args.size() });
+                } catch (exception &e) {
+                    output << "Error: " << e.what() << "\n";
+                }
+                this->flush(output);
+            }
+
+            void flush (ostringstream &output) {
+                if (output.tellp() <= 0) return;
+                lock_guard<mutex> guard(this->outputLock);
+                *this->out << output.str();
+                output.str("");
+            }
+    };
+}
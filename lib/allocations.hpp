@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace Deluxe {
+    // Process-wide count of heap allocations made through operator new, for --stats and benchmarks.
+    // The counting operators replace the global ones and make every allocation of every thread pay for an
+    // atomic increment, so they are only compiled in when the build defines DELUXE_COUNT_ALLOCATIONS
+    // (make stats, make bench); otherwise the count stays zero.
+    class Allocations {
+        public:
+#ifdef DELUXE_COUNT_ALLOCATIONS
+            static const bool enabled = true;
+#else
+            static const bool enabled = false;
+#endif
+
+
+            static atomic<size_t> &counter () {
+                static atomic<size_t> count(0);
+                return count;
+            }
+
+            static size_t count () {
+                return Allocations::counter().load(memory_order_relaxed);
+            }
+    };
+}
+
+#ifdef DELUXE_COUNT_ALLOCATIONS
+// Kept out of line so callers never see new paired with free, which GCC would report as a mismatch
+__attribute__((noinline)) void *operator new (size_t size) {
+    Deluxe::Allocations::counter().fetch_add(1, memory_order_relaxed);
+    void *result = malloc(size == 0 ? 1 : size);
+    if (result == nullptr) throw bad_alloc();
+    return result;
+}
+
+__attribute__((noinline)) void *operator new[] (size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete (void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[] (void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete (void *pointer, size_t) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[] (void *pointer, size_t) noexcept {
+    free(pointer);
+}
+#endif
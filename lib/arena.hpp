@@ -0,0 +1,67 @@
+#pragma once
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+namespace Deluxe {
+    // Bump allocator for trivially destructible data that lives as long as the arena, e.g. parse trees
+    class Arena {
+        public:
+            vector<unique_ptr<char[]>> blocks;
+            char *cursor;
+            size_t remaining;
+            size_t blockSize;
+            size_t bytesAllocated;
+            vector<shared_ptr<const void>> retained;
+
+            // Blocks start small, so a single streamed form stays cheap, and double up to 1 MB
+            Arena (size_t blockSize = 4 * 1024) {
+                this->cursor = nullptr;
+                this->remaining = 0;
+                this->blockSize = blockSize;
+                this->bytesAllocated = 0;
+            }
+
+            Arena (const Arena&) = delete;
+            Arena &operator= (const Arena&) = delete;
+
+            void *allocate (size_t size, size_t alignment) {
+                size_t padding = (alignment - (uintptr_t)this->cursor % alignment) % alignment;
+                if (padding + size > this->remaining) {
+                    size_t capacity = size + alignment > this->blockSize ? size + alignment : this->blockSize;
+                    if (this->blockSize < 1024 * 1024) this->blockSize *= 2;
+                    this->blocks.push_back(unique_ptr<char[]>(new char[capacity]));
+                    this->cursor = this->blocks.back().get();
+                    this->remaining = capacity;
+                    padding = (alignment - (uintptr_t)this->cursor % alignment) % alignment;
+                }
+                char *result = this->cursor + padding;
+                this->cursor += padding + size;
+                this->remaining -= padding + size;
+                this->bytesAllocated += size;
+                return result;
+            }
+
+            // Keeps memory referenced by arena data alive, e.g. the source text parse nodes slice into
+            void retain (shared_ptr<const void> owner) {
+                this->retained.push_back(owner);
+            }
+
+            template<typename T>
+            T *copy (const T *items, size_t count) {
+                if (count == 0) return nullptr;
+                T *result = static_cast<T*>(this->allocate(sizeof(T) * count, alignof(T)));
+                memcpy((void*)result, (const void*)items, sizeof(T) * count);
+                return result;
+            }
+
+            string_view copy (string_view text) {
+                if (text.empty()) return string_view();
+                return string_view(this->copy(text.data(), text.size()), text.size());
+            }
+    };
+}
@@ -0,0 +1,286 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "textfile.hpp"
+#include "compiler.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    class CacheException : public exception {
+        public:
+            string message;
+
+            CacheException (string message) {
+                this->message = string("Cache Exception: " + message);
+            }
+
+            const char * what () const throw () {
+                return this->message.c_str();
+            }
+    };
+
+    // Compiled programs saved as .dlxc files next to their source, so later runs skip lexing and parsing.
+    // Layout, all integers in host byte order:
+    //   header     "DLXC", version, sizeof(Instruction), options, source length, source hash
+    //   symbols    count, then length + bytes per name
+    //   natives    count, then length + bytes per name
+    //   functions  count, then per prototype: name, arity, localCount, line, instructions, lines, constants
+    // The file is memory-mapped on load; string constants slice straight into the mapping.
+    // Options are chosen by the caller for settings that change the compiled code, e.g. whether the Optimizer ran.
+    // Bump `version` whenever the instruction set, this layout or the code the Compiler and Optimizer emit changes.
+    class ProgramCache {
+        public:
+            static const uint32_t version = 5;
+
+            // foo.scm -> foo.dlxc
+            static string getPath (const string &source) {
+                size_t slash = source.find_last_of('/');
+                size_t dot = source.find_last_of('.');
+                if (dot == string::npos || (slash != string::npos && dot < slash)) return source + ".dlxc";
+                return source.substr(0, dot) + ".dlxc";
+            }
+
+            // FNV-1a over the whole source
+            static uint64_t hash (string_view source) {
+                uint64_t result = 14695981039346656037ull;
+                for (unsigned char ch : source) {
+                    result ^= ch;
+                    result *= 1099511628211ull;
+                }
+                return result;
+            }
+
+            template<typename T>
+            static void put (string &out, T value) {
+                out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+            }
+
+            static void putString (string &out, string_view text) {
+                ProgramCache::put<uint32_t>(out, text.size());
+                out.append(text.data(), text.size());
+            }
+
+            static string serialize (const Program &program, string_view source, uint32_t options) {
+                string out;
+                out.append("DLXC", 4);
+                ProgramCache::put<uint32_t>(out, ProgramCache::version);
+                ProgramCache::put<uint32_t>(out, sizeof(Instruction));
+                ProgramCache::put<uint32_t>(out, options);
+                ProgramCache::put<uint64_t>(out, source.size());
+                ProgramCache::put<uint64_t>(out, ProgramCache::hash(source));
+
+                ProgramCache::put<uint32_t>(out, program.symbols->size());
+                for (auto &name : program.symbols->names) ProgramCache::putString(out, name);
+                ProgramCache::put<uint32_t>(out, program.natives.size());
+                for (auto &name : program.natives) ProgramCache::putString(out, name);
+
+                ProgramCache::put<uint32_t>(out, program.functions.size());
+                for (auto &function : program.functions) {
+                    ProgramCache::putString(out, function.name);
+                    ProgramCache::put<uint32_t>(out, function.arity);
+                    ProgramCache::put<uint32_t>(out, function.localCount);
+                    ProgramCache::put<uint32_t>(out, function.line);
+                    ProgramCache::put<uint32_t>(out, function.code.size());
+                    out.append(reinterpret_cast<const char*>(function.code.data()), function.code.size() * sizeof(Instruction));
+                    out.append(reinterpret_cast<const char*>(function.lines.data()), function.lines.size() * sizeof(uint));
+                    ProgramCache::put<uint32_t>(out, function.constants.size());
+                    for (auto &constant : function.constants) {
+                        ProgramCache::put<uint8_t>(out, (uint8_t)constant.tag);
+                        if (constant.tag == ExpressionTag::NUMBER) ProgramCache::put<double>(out, constant.numberValue);
+                        else ProgramCache::putString(out, constant.stringValue);
+                    }
+                }
+                return out;
+            }
+
+            // Written to a temporary file first, so a concurrent reader never sees half a cache
+            static bool save (const string &path, const Program &program, string_view source, uint32_t options = 0) {
+                string data = ProgramCache::serialize(program, source, options);
+                string temporary = path + ".tmp" + to_string(getpid());
+                {
+                    ofstream out(temporary, ios::binary | ios::trunc);
+                    if (!out.write(data.data(), data.size())) {
+                        remove(temporary.c_str());
+                        return false;
+                    }
+                }
+                if (rename(temporary.c_str(), path.c_str()) != 0) {
+                    remove(temporary.c_str());
+                    return false;
+                }
+                return true;
+            }
+
+            // Bounds-checked cursor over the mapped file
+            struct Reader {
+                const char *cursor;
+                const char *end;
+
+                template<typename T>
+                T get () {
+                    if ((size_t)(this->end - this->cursor) < sizeof(T)) throw CacheException("Truncated cache file");
+                    T value;
+                    memcpy(&value, this->cursor, sizeof(T));
+                    this->cursor += sizeof(T);
+                    return value;
+                }
+
+                const char *take (size_t size) {
+                    if ((size_t)(this->end - this->cursor) < size) throw CacheException("Truncated cache file");
+                    const char *result = this->cursor;
+                    this->cursor += size;
+                    return result;
+                }
+
+                string_view getString () {
+                    uint32_t size = this->get<uint32_t>();
+                    return string_view(this->take(size), size);
+                }
+            };
+
+            // Fills `program` from the cache at `path` if it was compiled from exactly `source` with the same
+            // `options` against natives that still exist. Calls to natives are renumbered to match `natives`. Returns false when there is
+            // no usable cache; a damaged file raises a CacheException, also when its code would not run safely (see verify).
+            static bool load (const string &path, string_view source, const vector<string> &natives, Program &program, uint32_t options = 0) {
+                shared_ptr<Textfile> file;
+                try {
+                    file = Textfile::open(path);
+                } catch (TextfileException &e) {
+                    return false;
+                }
+                Reader reader { file->data, file->data + file->length };
+                if (file->length < 4 || memcmp(reader.take(4), "DLXC", 4) != 0) throw CacheException("Not a cache file: " + path);
+                if (reader.get<uint32_t>() != ProgramCache::version) return false;
+                if (reader.get<uint32_t>() != sizeof(Instruction)) return false;
+                if (reader.get<uint32_t>() != options) return false;
+                if (reader.get<uint64_t>() != source.size()) return false;
+                if (reader.get<uint64_t>() != ProgramCache::hash(source)) return false;
+
+                Program result;
+                result.symbols = make_shared<SymbolTable>();
+                uint32_t symbolCount = reader.get<uint32_t>();
+                for (uint32_t i = 0; i < symbolCount; i++) result.symbols->intern(reader.getString());
+
+                vector<uint> nativeIds;
+                uint32_t nativeCount = reader.get<uint32_t>();
+                for (uint32_t i = 0; i < nativeCount; i++) {
+                    auto name = reader.getString();
+                    uint id = 0;
+                    while (id < natives.size() && natives[id] != name) id++;
+                    if (id == natives.size()) return false;
+                    nativeIds.push_back(id);
+                }
+                result.natives = natives;
+
+                // String constants view into the mapping, which the arena keeps alive
+                auto arena = make_shared<Arena>();
+                arena->retain(file);
+                uint32_t functionCount = reader.get<uint32_t>();
+                for (uint32_t f = 0; f < functionCount; f++) {
+                    FunctionPrototype function;
+                    function.name = string(reader.getString());
+                    function.arity = reader.get<uint32_t>();
+                    function.localCount = reader.get<uint32_t>();
+                    function.line = reader.get<uint32_t>();
+                    function.arena = arena;
+                    uint32_t codeCount = reader.get<uint32_t>();
+                    function.code.resize(codeCount);
+                    memcpy((void*)function.code.data(), reader.take(codeCount * sizeof(Instruction)), codeCount * sizeof(Instruction));
+                    function.lines.resize(codeCount);
+                    memcpy(function.lines.data(), reader.take(codeCount * sizeof(uint)), codeCount * sizeof(uint));
+                    for (auto &ins : function.code) {
+                        if (ins.op != OpCode::CALL_NATIVE) continue;
+                        if (ins.a >= nativeIds.size()) throw CacheException("Invalid native in " + path);
+                        ins.a = nativeIds[ins.a];
+                    }
+                    uint32_t constantCount = reader.get<uint32_t>();
+                    for (uint32_t c = 0; c < constantCount; c++) {
+                        auto tag = (ExpressionTag)reader.get<uint8_t>();
+                        if (tag != ExpressionTag::NUMBER && tag != ExpressionTag::STRING) throw CacheException("Invalid constant in " + path);
+                        if (tag == ExpressionTag::NUMBER) {
+                            function.constants.push_back(Expression { tag, .numberValue = reader.get<double>() });
+                        } else {
+                            function.constants.push_back(Expression { tag, .stringValue = reader.getString() });
+                        }
+                    }
+                    result.functions.push_back(function);
+                }
+                if (result.functions.empty()) throw CacheException("No top level in " + path);
+                ProgramCache::verify(result, path);
+                program = result;
+                return true;
+            }
+
+            // The VM trusts its bytecode, so a cache is checked the way the Compiler would have written it: every
+            // index is in range, and since code runs straight through without jumps, the stack depth can be traced
+            // to make sure no instruction takes more values than the ones before it pushed and every function ends
+            // by returning or handing its frame over.
+            static void verify (const Program &program, const string &path) {
+                // Captured values of each prototype, given by the CLOSURE instructions creating it
+                vector<int> captures(program.functions.size(), -1);
+                for (auto &function : program.functions) {
+                    for (auto &ins : function.code) {
+                        if (ins.op != OpCode::CLOSURE) continue;
+                        if (ins.a == 0 || ins.a >= program.functions.size()) throw CacheException("Invalid function in " + path);
+                        if (captures[ins.a] >= 0 && captures[ins.a] != ins.b) throw CacheException("Invalid closure in " + path);
+                        captures[ins.a] = ins.b;
+                    }
+                }
+                size_t globals = program.symbols->size();
+                for (size_t f = 0; f < program.functions.size(); f++) {
+                    auto &function = program.functions[f];
+                    size_t captured = captures[f] < 0 ? 0 : captures[f];
+                    // Frames are allocated up front; each `let` slot beyond the parameters has an instruction binding it
+                    size_t defined = 0;
+                    for (auto &ins : function.code) defined += ins.op == OpCode::DEFINE_LOCAL;
+                    if (function.arity > function.localCount || function.localCount > (size_t)function.arity + defined) {
+                        throw CacheException("Invalid frame size in " + path);
+                    }
+                    size_t depth = 0;
+                    for (auto &ins : function.code) {
+                        size_t taken = 0;
+                        size_t index = 0;
+                        size_t limit = SIZE_MAX;    // of `index`
+                        switch (ins.op) {
+                            case OpCode::CONSTANT:      { index = ins.a; limit = function.constants.size(); break; }
+                            case OpCode::NONE:          { break; }
+                            case OpCode::LOAD_LOCAL:    { index = ins.a; limit = function.localCount; break; }
+                            case OpCode::LOAD_CAPTURE:  { index = ins.a; limit = captured; break; }
+                            case OpCode::LOAD_GLOBAL:
+                            case OpCode::LOAD_CALLABLE: { index = ins.a; limit = globals; break; }
+                            case OpCode::DEFINE_LOCAL:  { index = ins.a; limit = function.localCount; taken = 1; break; }
+                            case OpCode::DEFINE_GLOBAL: { index = ins.a; limit = globals; taken = 1; break; }
+                            case OpCode::CLOSURE:       { taken = ins.b; break; }
+                            case OpCode::CALL_NATIVE:   { index = ins.a; limit = program.natives.size(); taken = ins.b; break; }
+                            case OpCode::CALL:
+                            case OpCode::TAIL_CALL: {
+                                if (ins.a >= function.constants.size() || function.constants[ins.a].tag != ExpressionTag::STRING) {
+                                    throw CacheException("Invalid call in " + path);
+                                }
+                                taken = ins.b + 1;
+                                break;
+                            }
+                            case OpCode::POP:
+                            case OpCode::RETURN:        { taken = 1; break; }
+                            default:
+                                throw CacheException("Invalid instruction in " + path);
+                        }
+                        if (index >= limit) throw CacheException("Invalid operand in " + path);
+                        if (taken > depth) throw CacheException("Invalid stack use in " + path);
+                        depth = depth - taken + 1;
+                    }
+                    if (function.code.empty() || (function.code.back().op != OpCode::RETURN && function.code.back().op != OpCode::TAIL_CALL)) {
+                        throw CacheException("Invalid function end in " + path);
+                    }
+                }
+            }
+    };
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "parser.hpp"
+#include "arena.hpp"
+#include "symbols.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    enum class OpCode : uint8_t {
+        CONSTANT,       // push constants[a]
+        NONE,           // push none
+        LOAD_LOCAL,     // push slot a of the current frame
+        LOAD_CAPTURE,   // push captured value a of the running closure
+        LOAD_GLOBAL,    // push global a, or its symbol when unbound
+        LOAD_CALLABLE,  // push global a, fails when unbound
+        DEFINE_LOCAL,   // bind slot a of the current frame to the popped value unless it is already bound
+        DEFINE_GLOBAL,  // bind global a to the popped value unless it is already bound
+        CLOSURE,        // push a function for prototype a capturing the top b values
+        CALL_NATIVE,    // call native a with the top b values
+        CALL,           // call the value below the top b values (a is the constant holding its name)
+        TAIL_CALL,      // CALL that replaces the current frame; emitted for calls in tail position of a function
+        POP,
+        RETURN
+    };
+
+    struct Instruction {
+        OpCode op;
+        uint16_t b;
+        uint32_t a;
+    };
+
+    // Constants may point into the parse arena of the form that defined the function, which it keeps alive
+    struct FunctionPrototype {
+        string name;
+        uint arity;
+        uint localCount;
+        uint line;                  // of the defining `fn` form
+        vector<Instruction> code;
+        vector<uint> lines;         // source line of each instruction
+        vector<Expression> constants;
+        shared_ptr<Arena> arena;
+    };
+
+    // Globals are addressed by symbol id
+    struct Program {
+        shared_ptr<SymbolTable> symbols;
+        vector<string> natives;
+        vector<FunctionPrototype> functions; // functions[0] is the top level
+    };
+
+    class CompilerException : public exception {
+        public:
+            string message;
+
+            CompilerException (string message) {
+                this->message = string("Compiler Exception: " + message);
+            }
+
+            const char * what () const throw () {
+                return this->message.c_str();
+            }
+    };
+
+    class Compiler {
+        public:
+            Program program;
+            map<string, uint, less<>> nativeIndex;
+            shared_ptr<Arena> arena;
+            uint line;
+            vector<uint> released;  // prototypes the engine no longer uses, whose slots new functions take over
+
+            Compiler () {
+                this->line = 0;
+                this->program.functions.push_back(FunctionPrototype { .name = "main", .arity = 0, .localCount = 0 });
+            }
+
+            // Natives are call-by-value builtins; `let` and `fn` are compiled as special forms
+            Compiler (vector<string> natives) : Compiler() {
+                for (auto name = natives.begin(); name != natives.end(); ++name) {
+                    this->registerNative(*name);
+                }
+            }
+
+            uint registerNative (const string &name) {
+                uint index = this->program.natives.size();
+                this->nativeIndex.insert(pair<string, uint>(name, index));
+                this->program.natives.push_back(name);
+                return index;
+            }
+
+            static Program compile (const ParseResult &ast, vector<string> natives) {
+                Compiler compiler(natives);
+                compiler.compileTopLevel(ast);
+                return compiler.program;
+            }
+
+            // Replaces the top level (functions[0]) with `ast`; functions defined by earlier calls are kept,
+            // so a stream of forms can be compiled and run one at a time. Expects a tree annotated by the Resolver.
+            void compileTopLevel (const ParseResult &ast) {
+                this->program.symbols = ast.symbols;
+                this->arena = ast.arena;
+                this->program.functions[0] = FunctionPrototype { .name = "main", .arity = 0, .localCount = 0, .arena = ast.arena };
+                for (auto exp = ast.expressions.begin(); exp != ast.expressions.end(); ++exp) {
+                    this->compileExpression(0, *exp);
+                    this->emit(0, OpCode::POP);
+                }
+                this->emit(0, OpCode::NONE);
+                this->emit(0, OpCode::RETURN);
+            }
+
+            void emit (uint function, OpCode op, uint32_t a = 0, uint16_t b = 0) {
+                this->program.functions[function].code.push_back(Instruction { op, b, a });
+                this->program.functions[function].lines.push_back(this->line);
+            }
+
+            uint addConstant (uint function, Expression value) {
+                auto &constants = this->program.functions[function].constants;
+                constants.push_back(value);
+                return constants.size() - 1;
+            }
+
+            void compileLoad (uint function, const Expression &exp, OpCode global) {
+                if (exp.depth == 0) this->emit(function, OpCode::LOAD_LOCAL, exp.slot);
+                else if (exp.depth == 1) this->emit(function, OpCode::LOAD_CAPTURE, exp.slot);
+                else this->emit(function, global, exp.symbol);
+            }
+
+            void compileExpression (uint function, const Expression &exp) {
+                uint line = this->line;
+                this->line = exp.line;
+                switch (exp.tag) {
+                    case ExpressionTag::NUMBER:
+                    case ExpressionTag::STRING: {
+                        this->emit(function, OpCode::CONSTANT, this->addConstant(function, exp));
+                        break;
+                    }
+                    case ExpressionTag::SYMBOL: {
+                        this->compileLoad(function, exp, OpCode::LOAD_GLOBAL);
+                        break;
+                    }
+                    case ExpressionTag::CALL: {
+                        this->compileCall(function, exp);
+                        break;
+                    }
+                }
+                this->line = line;
+            }
+
+            void compileCall (uint function, const Expression &exp) {
+                if (exp.callName == "let") return this->compileLet(function, exp);
+                if (exp.callName == "fn") return this->compileFunction(function, exp);
+                auto native = this->nativeIndex.find(exp.callName);
+                if (native != this->nativeIndex.end()) {
+                    this->compileArguments(function, exp.callValue);
+                    this->emit(function, OpCode::CALL_NATIVE, native->second, exp.callValue.size());
+                    return;
+                }
+
+                this->compileLoad(function, exp, OpCode::LOAD_CALLABLE);
+                this->compileArguments(function, exp.callValue);
+                this->emit(function, OpCode::CALL, this->addConstant(function, Expression {
+                    .tag = ExpressionTag::STRING,
+                    .stringValue = exp.callName
+                }), exp.callValue.size());
+            }
+
+            void compileArguments (uint function, const ExpressionList &args) {
+                if (args.size() > UINT16_MAX) throw CompilerException("Too many arguments");
+                for (auto arg = args.begin(); arg != args.end(); ++arg) {
+                    this->compileExpression(function, *arg);
+                }
+            }
+
+            void compileLet (uint function, const Expression &exp) {
+                if (exp.callValue.empty()) {
+                    this->emit(function, OpCode::NONE);
+                    return;
+                }
+                auto sym = exp.callValue[0];
+                if (sym.tag != ExpressionTag::SYMBOL) throw CompilerException("Symbol expected");
+                if (exp.callValue.size() > 1) this->compileExpression(function, exp.callValue[1]);
+                else this->emit(function, OpCode::NONE);
+                if (sym.depth == 0) this->emit(function, OpCode::DEFINE_LOCAL, sym.slot);
+                else this->emit(function, OpCode::DEFINE_GLOBAL, sym.symbol);
+                this->emit(function, OpCode::NONE);
+            }
+
+            void compileFunction (uint function, const Expression &exp) {
+                uint arity = 0;
+                for (auto param = exp.callValue.begin(); param != exp.callValue.end(); ++param) {
+                    if (param->tag != ExpressionTag::SYMBOL) break;
+                    arity++;
+                }
+                FunctionPrototype prototype {
+                    .name = "fn",
+                    .arity = arity,
+                    .localCount = exp.slot,
+                    .line = exp.line,
+                    .arena = this->arena
+                };
+                uint index = this->program.functions.size();
+                if (this->released.empty()) {
+                    this->program.functions.push_back(prototype);
+                } else {
+                    index = this->released.back();
+                    this->released.pop_back();
+                    this->program.functions[index] = prototype;
+                }
+                if (arity == exp.callValue.size()) this->emit(index, OpCode::NONE);
+                for (auto body = exp.callValue.begin() + arity; body != exp.callValue.end(); ++body) {
+                    this->compileExpression(index, *body);
+                    if (body + 1 != exp.callValue.end()) this->emit(index, OpCode::POP);
+                }
+                // A body ending in a user call hands its frame over to the callee
+                auto &code = this->program.functions[index].code;
+                if (code.back().op == OpCode::CALL) code.back().op = OpCode::TAIL_CALL;
+                else this->emit(index, OpCode::RETURN);
+                // Captured values are read in the defining function, right where the closure is created
+                if (exp.captures.size() > UINT16_MAX) throw CompilerException("Too many captured variables");
+                for (auto capture = exp.captures.begin(); capture != exp.captures.end(); ++capture) {
+                    this->compileLoad(function, *capture, OpCode::LOAD_GLOBAL);
+                }
+                this->emit(function, OpCode::CLOSURE, index, exp.captures.size());
+            }
+    };
+}
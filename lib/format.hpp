@@ -0,0 +1,136 @@
+#pragma once
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "value.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    // A printf-style format string split into literal text and directives:
+    //   %s     any value, as printf prints it
+    //   %d %i  a number without its fraction
+    //   %f     a number with 6 decimals, or as many as given with %.2f
+    //   %%     a percent sign
+    // Anything else after a '%', and directives left without an argument, are copied as they are.
+    class Format {
+        public:
+            struct Segment {
+                uint start;         // literal text before the directive
+                uint length;
+                uint directive;     // the directive's own text, written when it has no argument
+                uint directiveLength;
+                char conversion;    // 0 after the last literal
+                int precision;      // -1 if none was given
+            };
+
+            string source;
+            vector<Segment> segments;
+
+            Format () {}
+
+            Format (string_view source) {
+                this->source = string(source);
+                size_t start = 0;
+                size_t i = 0;
+                while (i < source.size()) {
+                    if (source[i] != '%') {
+                        i++;
+                        continue;
+                    }
+                    if (i + 1 < source.size() && source[i + 1] == '%') {
+                        // The first '%' ends the literal, the second starts the next one
+                        this->segments.push_back(Segment { (uint)start, (uint)(i + 1 - start), 0, 0, 0, -1 });
+                        start = i + 2;
+                        i += 2;
+                        continue;
+                    }
+                    size_t end = i + 1;
+                    int precision = -1;
+                    if (end < source.size() && source[end] == '.') {
+                        precision = 0;
+                        for (end++; end < source.size() && isdigit((unsigned char)source[end]) && precision < 100; end++) {
+                            precision = precision * 10 + (source[end] - '0');
+                        }
+                    }
+                    if (end >= source.size() || string_view("sdif").find(source[end]) == string_view::npos) {
+                        i++;
+                        continue;
+                    }
+                    this->segments.push_back(Segment {
+                        (uint)start, (uint)(i - start), (uint)i, (uint)(end + 1 - i), source[end], precision
+                    });
+                    start = end + 1;
+                    i = end + 1;
+                }
+                this->segments.push_back(Segment { (uint)start, (uint)(source.size() - start), 0, 0, 0, -1 });
+            }
+
+            // Appends the formatted text to `out`, taking values from `values` starting at `first`;
+            // returns the index of the first value no directive used
+            size_t write (string &out, const Value *values, size_t count, size_t first) const {
+                size_t next = first;
+                for (auto &segment : this->segments) {
+                    out.append(this->source, segment.start, segment.length);
+                    if (segment.conversion == 0) continue;
+                    if (next >= count) {
+                        out.append(this->source, segment.directive, segment.directiveLength);
+                        continue;
+                    }
+                    Format::convert(out, segment, values[next++]);
+                }
+                return next;
+            }
+
+            static void convert (string &out, const Segment &segment, const Value &value) {
+                if (value.type != ValueType::NUMBER || segment.conversion == 's' || !isfinite(value.as.number)) {
+                    value.append(out);
+                    return;
+                }
+                char buffer[128];
+                double number = value.as.number;
+                if (segment.conversion == 'f') {
+                    int precision = segment.precision < 0 ? 6 : segment.precision;
+                    auto result = to_chars(buffer, buffer + sizeof(buffer), number, chars_format::fixed, precision);
+                    if (result.ec == errc()) out.append(buffer, result.ptr - buffer);
+                    else value.append(out);
+                    return;
+                }
+                double whole = trunc(number);
+                if (fabs(whole) >= 9.2e18) {
+                    value.append(out);
+                    return;
+                }
+                auto result = to_chars(buffer, buffer + sizeof(buffer), (long long)whole);
+                out.append(buffer, result.ptr - buffer);
+            }
+    };
+
+    // Parsed formats per call site, so a format is only parsed again when a site is handed a different one.
+    // A fixed table indexed by the site's address: streamed forms bring new sites for as long as the stream
+    // runs, so a site that collides with another one replaces it instead of the table growing.
+    class FormatCache {
+        public:
+            struct Entry {
+                const void *site = nullptr;
+                Format format;
+            };
+
+            static const size_t capacity = 256;   // a power of two
+            vector<Entry> entries;
+
+            const Format &get (const void *site, const string &source) {
+                if (this->entries.empty()) this->entries.resize(FormatCache::capacity);
+                Entry &entry = this->entries[MapObject::mix((uintptr_t)site) % FormatCache::capacity];
+                if (entry.site != site || entry.format.segments.empty() || entry.format.source != source) {
+                    entry.site = site;
+                    entry.format = Format(source);
+                }
+                return entry.format;
+            }
+    };
+}
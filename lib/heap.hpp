@@ -0,0 +1,315 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "value.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    // Fixed-size slots for one object type, carved out of large blocks by bumping a cursor.
+    // Slots freed by a collection are reused before the cursor moves on; objects never move.
+    template<typename T>
+    class Pool {
+        public:
+            static const size_t slotsPerBlock = 1024;
+
+            struct Block {
+                unique_ptr<char[]> memory;
+                vector<uint8_t> live;
+            };
+
+            vector<Block> blocks;
+            size_t cursor;      // next unused slot of the last block
+            vector<pair<uint32_t, uint32_t>> free;  // (block, slot)
+            size_t count;       // live objects
+
+            Pool () {
+                this->cursor = Pool::slotsPerBlock;
+                this->count = 0;
+            }
+
+            Pool (const Pool&) = delete;
+            Pool &operator= (const Pool&) = delete;
+
+            ~Pool () {
+                this->each([](T *object) { object->~T(); });
+            }
+
+            template<typename... Args>
+            T *allocate (Args&&... args) {
+                size_t block, slot;
+                if (!this->free.empty()) {
+                    block = this->free.back().first;
+                    slot = this->free.back().second;
+                    this->free.pop_back();
+                } else {
+                    if (this->cursor == Pool::slotsPerBlock) {
+                        this->blocks.push_back(Block { unique_ptr<char[]>(new char[sizeof(T) * Pool::slotsPerBlock]), vector<uint8_t>(Pool::slotsPerBlock, 0) });
+                        this->cursor = 0;
+                    }
+                    block = this->blocks.size() - 1;
+                    slot = this->cursor++;
+                }
+                T *object = new (this->blocks[block].memory.get() + sizeof(T) * slot) T(std::forward<Args>(args)...);
+                this->blocks[block].live[slot] = 1;
+                this->count++;
+                return object;
+            }
+
+            template<typename Visit>
+            void each (Visit visit) {
+                for (auto &block : this->blocks) {
+                    for (size_t i = 0; i < Pool::slotsPerBlock; i++) {
+                        if (block.live[i]) visit(reinterpret_cast<T*>(block.memory.get() + sizeof(T) * i));
+                    }
+                }
+            }
+
+            // Destroys every unmarked object and clears the marks of the rest; returns the bytes released
+            size_t sweep () {
+                size_t released = 0;
+                for (uint32_t b = 0; b < this->blocks.size(); b++) {
+                    auto &block = this->blocks[b];
+                    for (uint32_t i = 0; i < Pool::slotsPerBlock; i++) {
+                        if (!block.live[i]) continue;
+                        T *object = reinterpret_cast<T*>(block.memory.get() + sizeof(T) * i);
+                        if (object->marked) {
+                            object->marked = false;
+                            continue;
+                        }
+                        released += object->size;
+                        object->~T();
+                        block.live[i] = 0;
+                        this->free.push_back(pair<uint32_t, uint32_t>(b, i));
+                        this->count--;
+                    }
+                }
+                return released;
+            }
+
+            size_t getCapacity () const {
+                return this->blocks.size() * Pool::slotsPerBlock * sizeof(T);
+            }
+    };
+
+    // Collection tuning: the first collection runs once `threshold` bytes are in use,
+    // each later one once the heap has grown to `growth` times what survived the previous one
+    struct HeapOptions {
+        size_t threshold = 1024 * 1024;
+        double growth = 2.0;
+        bool enabled = true;
+    };
+
+    struct HeapStats {
+        size_t collections = 0;
+        size_t bytesAllocated = 0;  // over the heap's lifetime
+        size_t bytesFreed = 0;
+        size_t liveBytes = 0;       // currently in use
+        size_t peakBytes = 0;
+        double totalPause = 0;      // milliseconds
+        double maxPause = 0;
+    };
+
+    // Owns every runtime object of one engine. Objects live in per-type pools and are reclaimed by a
+    // non-moving mark-sweep collection. Native code and engine internals hold raw Object pointers, so the
+    // heap only collects when its engine calls collect() at a point where every live value is in a root.
+    class Heap {
+        public:
+            Pool<StringObject> strings;
+            Pool<FunctionObject> functions;
+            Pool<ListObject> lists;
+            Pool<MapObject> maps;
+            unordered_map<string, StringObject*> symbols;   // interned for the heap's lifetime
+            vector<Value> pinned;   // roots of every collection, see Pinned
+            unordered_set<Actor*> actors;   // reached by the last collection; the Scheduler owns them
+            HeapOptions options;
+            HeapStats stats;
+            size_t nextCollection;
+            vector<Object*> gray;
+
+            Heap () {
+                this->nextCollection = this->options.threshold;
+            }
+
+            Heap (const Heap&) = delete;
+            Heap &operator= (const Heap&) = delete;
+
+            void configure (const HeapOptions &options) {
+                this->options = options;
+                this->nextCollection = max(this->options.threshold, this->stats.liveBytes);
+            }
+
+            template<typename T>
+            void account (T *object, size_t size) {
+                object->size = size;
+                this->stats.bytesAllocated += size;
+                this->stats.liveBytes += size;
+                if (this->stats.liveBytes > this->stats.peakBytes) this->stats.peakBytes = this->stats.liveBytes;
+            }
+
+            template<typename... Args>
+            FunctionObject *makeFunction (Args&&... args) {
+                auto object = this->functions.allocate(std::forward<Args>(args)...);
+                this->account(object, sizeof(FunctionObject));
+                return object;
+            }
+
+            Value makeList (size_t capacity = 0) {
+                auto object = this->lists.allocate();
+                object->items.reserve(capacity);
+                this->account(object, sizeof(ListObject) + capacity * sizeof(Value));
+                return Value::fromObject(object);
+            }
+
+            Value makeMap (size_t capacity = 0) {
+                auto object = this->maps.allocate();
+                if (capacity > 0) object->reserve(capacity);
+                this->account(object, object->getSize());
+                return Value::fromObject(object);
+            }
+
+            // Accounts for a collection that grew or shrank since it was last accounted
+            void resize (Object *object, size_t size) {
+                if (size >= object->size) {
+                    this->stats.bytesAllocated += size - object->size;
+                    this->stats.liveBytes += size - object->size;
+                    if (this->stats.liveBytes > this->stats.peakBytes) this->stats.peakBytes = this->stats.liveBytes;
+                } else {
+                    this->stats.liveBytes -= object->size - size;
+                }
+                object->size = size;
+            }
+
+            void update (ListObject *list) {
+                size_t size = sizeof(ListObject) + list->items.capacity() * sizeof(Value);
+                if (size != list->size) this->resize(list, size);
+            }
+
+            void update (MapObject *map) {
+                size_t size = map->getSize();
+                if (size != map->size) this->resize(map, size);
+            }
+
+            Value makeString (const string &value) {
+                auto object = this->strings.allocate(ValueType::STRING, value);
+                this->account(object, sizeof(StringObject) + value.size());
+                return Value::fromObject(object);
+            }
+
+            Value makeSymbol (const string &name) {
+                if (name == "none") return Value::none();
+                auto found = this->symbols.find(name);
+                if (found != this->symbols.end()) return Value::fromObject(found->second);
+                auto object = this->strings.allocate(ValueType::SYMBOL, name);
+                this->account(object, sizeof(StringObject) + name.size());
+                this->symbols.insert(pair<string, StringObject*>(name, object));
+                return Value::fromObject(object);
+            }
+
+            // Converts a literal from the parse tree into a runtime value
+            Value fromExpression (const Expression &exp) {
+                switch (exp.tag) {
+                    case ExpressionTag::NUMBER: return Value::fromNumber(exp.numberValue);
+                    case ExpressionTag::STRING: return this->makeString(string(exp.stringValue));
+                    case ExpressionTag::SYMBOL: return this->makeSymbol(string(exp.symbolValue));
+                    default:
+                        return Value::none();
+                }
+            }
+
+            bool shouldCollect () const {
+                return this->options.enabled && this->stats.liveBytes >= this->nextCollection;
+            }
+
+            void mark (const Value &value) {
+                if (value.type == ValueType::NONE || value.type == ValueType::NUMBER) return;
+                if (value.type == ValueType::ACTOR) {
+                    this->actors.insert(value.as.actor);
+                    return;
+                }
+                if (value.type == ValueType::UNBOUND) return;
+                this->markObject(value.as.object);
+            }
+
+            void markObject (Object *object) {
+                if (object == nullptr || object->marked) return;
+                object->marked = true;
+                if (object->type != ValueType::STRING && object->type != ValueType::SYMBOL) this->gray.push_back(object);
+            }
+
+            void markAll (const vector<Value> &values) {
+                for (auto &value : values) this->mark(value);
+            }
+
+            // `markRoots` marks every value the engine can still reach; everything else is freed
+            template<typename Roots>
+            void collect (Roots markRoots) {
+                auto start = chrono::steady_clock::now();
+                this->actors.clear();
+                for (auto &symbol : this->symbols) this->markObject(symbol.second);
+                this->markAll(this->pinned);
+                markRoots(*this);
+                this->trace();
+                size_t released = this->strings.sweep() + this->functions.sweep() + this->lists.sweep() + this->maps.sweep();
+                this->stats.bytesFreed += released;
+                this->stats.liveBytes -= released;
+                this->stats.collections++;
+                this->nextCollection = max(this->options.threshold, (size_t)(this->stats.liveBytes * this->options.growth));
+                double pause = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                this->stats.totalPause += pause;
+                this->stats.maxPause = max(this->stats.maxPause, pause);
+            }
+
+            // Marks everything reachable from the objects marked so far; roots may call it to see what is live
+            void trace () {
+                while (!this->gray.empty()) {
+                    Object *object = this->gray.back();
+                    this->gray.pop_back();
+                    if (object->type == ValueType::FUNCTION) {
+                        this->markAll(static_cast<FunctionObject*>(object)->captures);
+                    } else if (object->type == ValueType::LIST) {
+                        this->markAll(static_cast<ListObject*>(object)->items);
+                    } else {
+                        for (auto &entry : static_cast<MapObject*>(object)->entries) {
+                            this->mark(entry.key);
+                            this->mark(entry.value);
+                        }
+                    }
+                }
+            }
+
+            // Bytes reserved by the pools, live or free
+            size_t getCapacity () const {
+                return this->strings.getCapacity() + this->functions.getCapacity() + this->lists.getCapacity() + this->maps.getCapacity();
+            }
+    };
+
+    // Keeps values a native holds in C++ variables alive while it calls back into script code, which may
+    // collect; they are released when the Pinned goes out of scope
+    class Pinned {
+        public:
+            Heap &heap;
+            size_t mark;
+
+            Pinned (Heap &heap) : heap(heap) {
+                this->mark = heap.pinned.size();
+            }
+
+            ~Pinned () {
+                this->heap.pinned.resize(this->mark);
+            }
+
+            Value add (Value value) {
+                this->heap.pinned.push_back(value);
+                return value;
+            }
+    };
+}
@@ -1,38 +1,24 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <string>
-#include <map>
-#include <stack>
+#include <vector>
+
+#include <sys/resource.h>
 
 #include "parser.hpp"
+#include "value.hpp"
+#include "heap.hpp"
+#include "symbols.hpp"
+#include "resolver.hpp"
+#include "natives.hpp"
+#include "profiler.hpp"
 
 using namespace std;
 using namespace Deluxe;
 
 namespace Deluxe {
-    
-    typedef std::function<void(vector<Expression>)> RuntimeFunction;
-    typedef map<string, Expression> EnvironmentScope;
-    typedef vector<Expression> ExpressionList;
-
-
-    class FunctionObject {
-        public:
-            vector<string> arguments;
-            EnvironmentScope scope;
-            RuntimeFunction body;
-
-            FunctionObject (vector<string> args, EnvironmentScope scope, RuntimeFunction body) {
-                this->arguments = vector<string>(args);
-                this->scope = EnvironmentScope(scope);
-                this->body = RuntimeFunction(body);
-            }
-    };
-    
-    union InterpreterExpression {
-        Expression expression;
-        FunctionObject function;
-    };
 
     class RuntimeException : public exception {
         public:
@@ -57,175 +43,477 @@ namespace Deluxe {
             }
     };
     
+    // What a call site dispatched to when it was last resolved. Still valid while the interpreter's
+    // `version` is unchanged, since only new global bindings and new builtins change what a name means.
+    struct CallSite {
+        enum Kind : uint8_t { EMPTY, LET, FN, NATIVE, GLOBAL, SCOPE };
+
+        uint version;
+        Kind kind;
+        int native;     // NATIVE: index into natives
+        Value target;   // GLOBAL: the binding of the name, unbound if there is none yet
+    };
+
+    // The call sites inside the functions of one executed form. Functions made from the form keep its arena
+    // alive, so once the arena is gone nothing can reach these sites anymore.
+    struct SiteBlock {
+        weak_ptr<Arena> arena;
+        uint first;
+        uint count;
+    };
+
     class Interpreter {
         public:
             unique_ptr<Deluxe::ParseResult> ast;
-            std::map<string, RuntimeFunction> runtime;
-            std::map<string, Expression> environment;
-            stack<Expression> stack;
+            shared_ptr<SymbolTable> symbols;
+            shared_ptr<Arena> arena;
+            Heap heap;
+            Natives natives;
+            NativeContext context;
+            vector<CallSite> sites;     // per call site numbered by the Resolver
+            vector<SiteBlock> siteBlocks;   // of the forms run by execute, until they are released
+            vector<pair<uint, uint>> freeSites; // released ranges of `sites` below the end, as first and count
+            size_t siteCollections;     // of the heap when `siteBlocks` were last checked
+            uint version;               // bumped whenever a cached call site may have gone stale
+            size_t cacheHits;
+            size_t cacheMisses;
+            vector<Value> globals;
+            vector<Value> symbolValues;
+            vector<Value> locals;       // frames of the calls in progress: arguments first, then `let` slots
+            size_t base;                // first slot of the current frame
+            FunctionObject *closure;    // function being run, null at the top level
+            vector<Value> stack;        // evaluated arguments of the calls in progress
+            Profiler *profiler;         // records calls when set
+            uint depth;                 // user calls in progress
+            uint maxDepth;
+            uintptr_t stackStart;       // C++ stack position when the outermost call began
+            size_t stackBudget;         // C++ stack the evaluator may use below that
 
-            Interpreter(Deluxe::ParseResult ast) {
+            Interpreter(shared_ptr<SymbolTable> symbols) : natives(Natives::standard()), context(&heap, &cout) {
+                this->symbols = symbols;
+                this->context.apply = [this](Value function, Arguments args) { return this->apply(function, args); };
+                this->version = 1;
+                this->cacheHits = 0;
+                this->cacheMisses = 0;
+                this->siteCollections = 0;
+                this->base = 0;
+                this->closure = nullptr;
+                this->profiler = nullptr;
+                this->depth = 0;
+                this->maxDepth = 5000;
+                this->stackStart = 0;
+                this->stackBudget = Interpreter::getStackBudget();
+            }
+
+            Interpreter(Deluxe::ParseResult ast) : Interpreter(ast.symbols) {
                 this->ast = make_unique<Deluxe::ParseResult>(ast);
-                this->initialize();
             }
 
-            Expression getNone () {
-                return Expression {
-                        .tag = ExpressionTag::SYMBOL,
-                        .symbolValue = "none"
-                    };
+            // A new interpreter for another thread, sharing the parse trees and symbols but with its own heap.
+            // Globals are passed as portable copies, since this interpreter's heap may not be read concurrently.
+            unique_ptr<Interpreter> fork(const vector<Portable> &globals) const {
+                auto engine = make_unique<Interpreter>(this->symbols);
+                engine->natives = this->natives;
+                engine->context.scheduler = this->context.scheduler;
+                engine->heap.configure(this->heap.options);
+                engine->maxDepth = this->maxDepth;
+                engine->arena = this->arena;
+                engine->sites.resize(this->sites.size(), CallSite { 0 });
+                engine->symbolValues.resize(this->symbolValues.size(), Value::unbound());
+                for (auto &value : globals) engine->globals.push_back(value.materialize(engine->heap));
+                return engine;
             }
 
-            void initialize () {
-                RuntimeFunction printf = [&](vector<Expression> params) {
-                    auto args = this->executeAll(params);
-                    for (auto it = args.begin(); it != args.end(); ++it) {
-                        switch (it->tag) {
-                            case ExpressionTag::NUMBER: { cout << to_string(it->numberValue); break; }
-                            case ExpressionTag::STRING: { cout << it->stringValue; break; }
-                            case ExpressionTag::CALL:   { cout << "@CALL " << it->callName; break; }
-                            case ExpressionTag::SYMBOL: { cout << "#" << it->symbolValue; break; }
-                        }
-                    }
-                    cout << endl;
-                };
+            Value getNone () {
+                return Value::none();
+            }
 
-                RuntimeFunction fnReturn = [&](vector<Expression> params){
-                    auto args = this->executeAll(params);
-                    for (auto it = args.begin(); it != args.end(); ++it) {
-                        this->stack.push(*it);
-                    }
-                };
-
-                RuntimeFunction fnLet = [&](vector<Expression> params) {
-                    if (params.size() == 0) return;
-                    Expression val = this->getNone();
-                    auto sym = params[0];
-                    if (params.size() >= 1) val = this->executeExpression(params[1]);
-                    if (sym.tag != ExpressionTag::SYMBOL) throw RuntimeException("Symbol expected");
-                    this->environment.insert(pair<string, Expression>(sym.symbolValue, val));
-                };
-
-                RuntimeFunction callFn =[&](vector<Expression> params) {
-                    Expression fnName = params[0];
-                    // auto arguments = 
-                };
-
-                RuntimeFunction defineFunction = [&](vector<Expression> params) {
-                    vector<string> argumentNames;
-                    uint paramCount = 0;
-                    for (auto param = params.begin(); param != params.end(); ++param) {
-                        if (param->tag != ExpressionTag::SYMBOL) break;
-                        paramCount++;
-                        argumentNames.push_back(param->symbolValue);
+            // Registers a host builtin; it takes precedence over script bindings of the same name
+            void define (const string &name, NativeFunction function, bool pure = false) {
+                this->natives.define(name, function, pure);
+                this->version++;
+            }
+
+            // Resolves what `call` invokes, reusing the answer from the last time while it is current.
+            // Names bound in a frame or a closure differ from call to call, so those are only classified.
+            const CallSite &getCallSite(const Expression &call) {
+                CallSite &site = this->sites[call.site];
+                if (site.version == this->version) {
+                    this->cacheHits++;
+                    return site;
+                }
+                this->cacheMisses++;
+                site.version = this->version;
+                site.native = -1;
+                site.target = Value::unbound();
+                if (call.callName.empty()) site.kind = CallSite::EMPTY;
+                else if (call.callName == "let") site.kind = CallSite::LET;
+                else if (call.callName == "fn") site.kind = CallSite::FN;
+                else if ((site.native = this->natives.find(call.callName)) >= 0) site.kind = CallSite::NATIVE;
+                else if (call.depth >= 0) site.kind = CallSite::SCOPE;
+                else {
+                    site.kind = CallSite::GLOBAL;
+                    site.target = this->globals[call.symbol];
+                }
+                return site;
+            }
+
+            // `let` binds once: rebinding a global or a frame slot leaves the first value in place
+            void letBinding(const Expression &symbol, Value value) {
+                Value &binding = symbol.depth < 0 ? this->globals[symbol.symbol] : this->locals[this->base + symbol.slot];
+                if (binding.isBound()) return;
+                binding = value;
+                if (symbol.depth < 0) this->version++;
+            }
+
+            Value evaluateLet(const Expression &exp) {
+                if (exp.callValue.size() == 0) return this->getNone();
+                Value val = this->getNone();
+                auto &sym = exp.callValue[0];
+                if (exp.callValue.size() > 1) val = this->executeExpression(exp.callValue[1]);
+                if (sym.tag != ExpressionTag::SYMBOL) throw RuntimeException("Symbol expected");
+                this->letBinding(sym, val);
+                return this->getNone();
+            }
+
+            Value evaluateFunction(const Expression &exp) {
+                uint paramCount = 0;
+                for (auto param = exp.callValue.begin(); param != exp.callValue.end(); ++param) {
+                    if (param->tag != ExpressionTag::SYMBOL) break;
+                    paramCount++;
+                }
+                auto callBody = ExpressionList { exp.callValue.begin() + paramCount, exp.callValue.count - paramCount };
+                // Inside a function the body may come from an older form, or from another engine's program
+                auto function = this->heap.makeFunction(paramCount, exp.slot, callBody, this->closure != nullptr ? this->closure->arena : this->arena);
+                function->line = exp.line;
+                function->captures.reserve(exp.captures.size());
+                for (auto capture = exp.captures.begin(); capture != exp.captures.end(); ++capture) {
+                    function->captures.push_back(this->getSymbolValue(*capture));
+                }
+                return Value::fromObject(function);
+            }
+
+            void run () {
+                this->execute(*this->ast);
+            }
+
+            // Runs the top-level forms of `form`; symbols must come from this interpreter's table,
+            // which may have grown since the last call. Calls outside functions get sites past the end, which
+            // the next form reuses. Those inside functions keep theirs until the functions are gone, so a stream
+            // of forms does not grow `sites` without end.
+            Value execute(ParseResult &form) {
+                Resolver resolver = Resolver::scan(form);
+                uint count = resolver.inside.size();
+                uint first = this->allocateSites(count);
+                for (uint i = 0; i < count; i++) resolver.inside[i]->site = first + i;
+                if (count > 0) this->siteBlocks.push_back(SiteBlock { form.arena, first, count });
+                uint end = this->sites.size();
+                uint sites = end;
+                for (auto exp : resolver.outside) exp->site = sites++;
+                try {
+                    Value result = this->executeResolved(form, sites);
+                    this->sites.resize(end);
+                    this->releaseSites();
+                    return result;
+                } catch (...) {
+                    this->sites.resize(end);
+                    throw;
+                }
+            }
+
+            // `count` sites in a row: the first released range they fit in, or new ones at the end
+            uint allocateSites(uint count) {
+                if (count == 0) return this->sites.size();
+                for (auto range = this->freeSites.begin(); range != this->freeSites.end(); ++range) {
+                    if (range->second < count) continue;
+                    uint first = range->first;
+                    range->first += count;
+                    range->second -= count;
+                    if (range->second == 0) this->freeSites.erase(range);
+                    return first;
+                }
+                uint first = this->sites.size();
+                this->sites.resize(first + count, CallSite { 0 });
+                return first;
+            }
+
+            // Releases the sites of forms whose arenas are gone. Only a collection frees functions, so the blocks
+            // are checked once after each.
+            void releaseSites() {
+                if (this->heap.stats.collections == this->siteCollections) return;
+                this->siteCollections = this->heap.stats.collections;
+                size_t kept = 0;
+                for (auto &block : this->siteBlocks) {
+                    if (!block.arena.expired()) {
+                        this->siteBlocks[kept++] = block;
+                        continue;
                     }
-                    auto callBody = ExpressionList(params.begin() + paramCount, params.end());
-                    auto body = this->getCallableBody(argumentNames, this->environment, callBody);
-                    FunctionObject fun(argumentNames, this->environment, body);
-                    this->stack.push(Expression {
-                        .tag = ExpressionTag::CALL,
-                        .callValue = callBody
-                    });
-                    // TODO: CALL cannFn with FunctionObject
-                };
-
-                this->runtime.insert(pair<string, RuntimeFunction>("printf", printf));
-                this->runtime.insert(pair<string, RuntimeFunction>("return", fnReturn));
-                this->runtime.insert(pair<string, RuntimeFunction>("let", fnLet));
-                this->runtime.insert(pair<string, RuntimeFunction>("fn", defineFunction));
-            }
-
-            void letBinding(string symbolName, Expression value) {
-                this->environment.insert(pair<string, Expression>(symbolName, value));
-            }
-
-            RuntimeFunction getCallableBody (vector<string> arguments, EnvironmentScope scope, ExpressionList body) {
-                return [&](vector<Expression> params) {
-                    uint i = 0;
-                    cout << "CALL BODY CALL" << endl;
-                    for (auto arg = arguments.begin(); arg != arguments.end(); ++arg) {
-                        auto param = params[i++];
-                        this->letBinding(*arg, param);
+                    fill(this->sites.begin() + block.first, this->sites.begin() + block.first + block.count, CallSite { 0 });
+                    auto range = lower_bound(this->freeSites.begin(), this->freeSites.end(), pair<uint, uint>(block.first, 0));
+                    if (range != this->freeSites.end() && block.first + block.count == range->first) {
+                        range->first = block.first;
+                        range->second += block.count;
+                    } else {
+                        range = this->freeSites.insert(range, { block.first, block.count });
                     }
-                    auto results = this->executeAll(body, scope);
-                    for (auto it = results.begin(); it != results.end(); ++it) {
-                        this->stack.push(*it);
+                    if (range != this->freeSites.begin()) {
+                        auto previous = range - 1;
+                        if (previous->first + previous->second == range->first) {
+                            previous->second += range->second;
+                            this->freeSites.erase(range);
+                        }
                     }
-                };
+                }
+                this->siteBlocks.resize(kept);
+                while (!this->freeSites.empty() && this->freeSites.back().first + this->freeSites.back().second == this->sites.size()) {
+                    this->sites.resize(this->freeSites.back().first);
+                    this->freeSites.pop_back();
+                }
             }
 
-            vector<Expression> executeAll(vector<Expression> expressions) {
-                vector<Expression> results;
-                for (auto exp = expressions.begin(); exp != expressions.end(); ++exp) {
-                    results.push_back(this->executeExpression(*exp));
+            // Runs forms the Resolver has already seen, numbering call sites below `sites`. They are only read,
+            // so any number of interpreters may run the same forms at the same time.
+            Value executeResolved(const ParseResult &form, uint sites) {
+                this->sites.resize(max((size_t)sites, this->sites.size()), CallSite { 0 });
+                this->globals.resize(this->symbols->size(), Value::unbound());
+                this->symbolValues.resize(this->symbols->size(), Value::unbound());
+                // A previous form may have been abandoned by an exception halfway through its arguments
+                this->stack.clear();
+                this->arena = form.arena;
+                Value result = this->getNone();
+                for (auto exp = form.expressions.begin(); exp != form.expressions.end(); ++exp) {
+                    this->collectGarbage();
+                    result = this->executeExpression(*exp);
                 }
-                return results;
+                return result;
+            }
+
+            // Forgets every global binding, so the program can run again from a clean slate; interned symbols,
+            // natives and the heap's memory stay
+            void reset() {
+                fill(this->globals.begin(), this->globals.end(), Value::unbound());
+                this->stack.clear();
+                this->locals.clear();
+                this->base = 0;
+                this->closure = nullptr;
+                this->depth = 0;
+                this->version++;
             }
 
-            vector<Expression> executeAll(vector<Expression> expressions, EnvironmentScope scope) {
-                vector<Expression> results;
+            // Only called where every live value is in a global, a frame, the argument stack or a running
+            // closure: between top-level forms and on entry to a function
+            void collectGarbage (bool force = false) {
+                if (!force && !this->heap.shouldCollect()) return;
+                this->heap.collect([&](Heap &heap) {
+                    heap.markAll(this->globals);
+                    heap.markAll(this->symbolValues);
+                    heap.markAll(this->locals);
+                    heap.markAll(this->stack);
+                    heap.markObject(this->closure);
+                });
+            }
+
+            // Evaluates `expressions` onto the value stack and returns their position; the caller pops them
+            size_t pushAll(const ExpressionList &expressions) {
+                size_t first = this->stack.size();
                 for (auto exp = expressions.begin(); exp != expressions.end(); ++exp) {
-                    results.push_back(this->executeExpression(*exp, scope));
+                    Value value = this->executeExpression(*exp);
+                    this->stack.push_back(value);
+                }
+                return first;
+            }
+
+            Value callNative(int native, const Expression &call) {
+                size_t first = this->pushAll(call.callValue);
+                this->context.calls++;
+                this->context.site = &call;
+                Arguments args { this->stack.data() + first, this->stack.size() - first };
+                Value result;
+                if (this->profiler == nullptr) {
+                    result = this->natives.functions[native](this->context, args);
+                } else {
+                    // Only the builtin itself is timed, not the evaluation of its arguments
+                    size_t depth = this->profiler->active.size();
+                    this->profiler->enter(this->profiler->entry(true, call.callName, call.line));
+                    try {
+                        result = this->natives.functions[native](this->context, args);
+                    } catch (...) {
+                        this->profiler->unwind(depth);
+                        throw;
+                    }
+                    this->profiler->exit();
+                }
+                this->stack.resize(first);
+                return result;
+            }
+
+            Value getSymbolValue(const Expression &symbol) {
+                if (symbol.depth == 0) return this->locals[this->base + symbol.slot];
+                if (symbol.depth == 1) return this->closure->captures[symbol.slot];
+                return this->globals[symbol.symbol];
+            }
+
+            // Arguments are evaluated in the caller and bound in a new frame on top of `locals`.
+            // A user call in tail position of the body replaces that frame instead of nesting another one,
+            // so tail recursion runs in constant space; other calls count towards `maxDepth`.
+            Value callFunction(const Expression &call, Value function) {
+                if (!function.isFunction()) throw RuntimeException("Not a function: " + string(call.callName));
+                this->checkDepth(call);
+                size_t first = this->pushAll(call.callValue);
+                return this->runFunction(call, function, first);
+            }
+
+            // Calls `function` from host code, e.g. as an actor's handler, while no script code runs
+            Value invoke(Value function, Arguments args) {
+                static const Expression call { ExpressionTag::CALL, .callName = "invoke" };
+                if (!function.isFunction()) throw RuntimeException("Not a function");
+                this->stack.clear();
+                this->checkDepth(call);
+                this->stack.insert(this->stack.end(), args.begin(), args.end());
+                return this->runFunction(call, function, 0);
+            }
+
+            // Calls `function` for a native, e.g. for-each, in the middle of the native's own call. The argument
+            // stack may move, so `args` must not point into it.
+            Value apply(Value function, Arguments args) {
+                static const Expression call { ExpressionTag::CALL, .callName = "apply" };
+                if (!function.isFunction()) throw RuntimeException("Not a function");
+                this->checkDepth(call);
+                size_t first = this->stack.size();
+                this->stack.insert(this->stack.end(), args.begin(), args.end());
+                return this->runFunction(call, function, first);
+            }
+
+            void checkDepth(const Expression &call) {
+                if (this->depth >= this->maxDepth) {
+                    throw RuntimeException("Maximum call depth of " + to_string(this->maxDepth) + " exceeded", call.line);
+                }
+                // Non-tail calls nest on the C++ stack; running out of it must not crash the process
+                uintptr_t position = (uintptr_t)__builtin_frame_address(0);
+                if (this->depth == 0) this->stackStart = position;
+                else if (this->stackStart > position && this->stackStart - position > this->stackBudget) {
+                    throw RuntimeException("Call stack exhausted at depth " + to_string(this->depth), call.line);
+                }
+            }
+
+            // Runs `function` with the arguments on the argument stack from `first`
+            Value runFunction(const Expression &call, Value function, size_t first) {
+                size_t base = this->locals.size();
+                size_t previousBase = this->base;
+                FunctionObject *previous = this->closure;
+                size_t profiled = this->profiler != nullptr ? this->profiler->active.size() : 0;
+                this->depth++;
+                Value result = this->getNone();
+                try {
+                    this->bind(call, function, first, first, base);
+                    for (;;) {
+                        auto &body = this->closure->body;
+                        if (body.empty()) break;
+                        for (auto exp = body.begin(); exp + 1 != body.end(); ++exp) {
+                            this->executeExpression(*exp);
+                        }
+                        const Expression &last = body.back();
+                        if (last.tag != ExpressionTag::CALL) {
+                            result = this->executeExpression(last);
+                            break;
+                        }
+                        const CallSite &site = this->getCallSite(last);
+                        Value next;
+                        if (!this->isTailCall(last, site, next)) {
+                            result = this->call(last, site);
+                            break;
+                        }
+                        size_t arguments = this->pushAll(last.callValue);
+                        if (this->profiler != nullptr) this->profiler->exit();
+                        this->bind(last, next, arguments, first, base);
+                    }
+                } catch (...) {
+                    if (this->profiler != nullptr) this->profiler->unwind(profiled);
+                    this->depth--;
+                    this->leave(first, base, previousBase, previous);
+                    throw;
                 }
-                return results;
+                if (this->profiler != nullptr) this->profiler->exit();
+                this->depth--;
+                this->leave(first, base, previousBase, previous);
+                return result;
+            }
+
+            // The soft stack limit less room for natives and the rest of the process
+            static size_t getStackBudget() {
+                rlimit limit;
+                size_t size = 8 * 1024 * 1024;
+                if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) size = limit.rlim_cur;
+                return size > 2 * 1024 * 1024 ? size - 1024 * 1024 : size / 2;
             }
 
-            Expression getSymbolValue(string symbol, std::map<string, Expression> env) {
-                auto val = env.find(symbol);
-                if (val == env.end()) {
-                    return this->getNone();
+            // A call of a user function that can reuse the current frame
+            bool isTailCall(const Expression &exp, const CallSite &site, Value &function) {
+                if (site.kind == CallSite::GLOBAL) function = site.target;
+                else if (site.kind == CallSite::SCOPE) function = this->getSymbolValue(exp);
+                else return false;
+                return function.isFunction();
+            }
+
+            // Makes `function` the running closure with a fresh frame at `base`, taking its arguments from the
+            // argument stack at `arguments`. The callee itself stays on the argument stack at `slot`, which keeps
+            // the closures of all running calls reachable.
+            void bind(const Expression &call, Value function, size_t arguments, size_t slot, size_t base) {
+                auto callee = function.asFunction();
+                size_t count = this->stack.size() - arguments;
+                this->locals.resize(base);
+                this->locals.resize(base + callee->frameSize, Value::unbound());
+                for (uint i = 0; i < callee->arity; i++) {
+                    this->locals[base + i] = i < count ? this->stack[arguments + i] : this->getNone();
                 }
-                return val->second;
+                this->stack.resize(slot);
+                this->stack.push_back(function);
+                this->base = base;
+                this->closure = callee;
+                this->collectGarbage();
+                if (this->profiler != nullptr) this->profiler->enter(this->profiler->entry(false, call.callName, callee->line));
             }
 
-            Expression executeExpression(Expression exp, std::map<string, Expression> env) {
+            void leave(size_t arguments, size_t frame, size_t base, FunctionObject *closure) {
+                this->stack.resize(arguments);
+                this->locals.resize(frame);
+                this->base = base;
+                this->closure = closure;
+            }
+
+            Value call(const Expression &exp, const CallSite &site) {
+                switch (site.kind) {
+                    case CallSite::LET: return this->evaluateLet(exp);
+                    case CallSite::FN: return this->evaluateFunction(exp);
+                    case CallSite::NATIVE: return this->callNative(site.native, exp);
+                    case CallSite::GLOBAL:
+                    case CallSite::SCOPE: {
+                        auto scopeFn = site.kind == CallSite::GLOBAL ? site.target : this->getSymbolValue(exp);
+                        if (!scopeFn.isBound()) throw RuntimeException("Undefined function " + string(exp.callName));
+                        return this->callFunction(exp, scopeFn);
+                    }
+                    default:
+                        return this->getNone();
+                }
+            }
+
+            Value executeExpression(const Expression &exp) {
                 switch (exp.tag) {
                     case ExpressionTag::CALL: {
-                        string functionName(exp.callName);
-                        if (!functionName.empty()) {
-                            auto function = this->runtime.find(functionName);
-                            if (function == this->runtime.end()) {
-                                // Execute scope function
-                                auto scopeFn = this->environment.find(functionName);
-                                if (scopeFn != this->environment.end()) {
-                                    cout << "FN " << functionName << endl;
-                                    executeExpression(scopeFn->second, env);
-                                    cout << this->stack.size() << endl;
-                                    // executeExpression(this->stack.top(), env);
-                                    break;
-                                } else {
-                                    throw RuntimeException("Undefined function " + functionName);
-                                }
-                            }
-                            // vector<Expression> parameters;
-                            // for (auto param = exp.callValue.begin(); param != exp.callValue.end(); ++param) {
-                            //     parameters.push_back(this->executeExpression(*param));
-                            // }
-                            function->second(exp.callValue);
-                        }
-                        break;
+                        return this->call(exp, this->getCallSite(exp));
                     }
                     case ExpressionTag::SYMBOL: {
-                        auto val = this->environment.find(exp.symbolValue);
-                        if (val == this->environment.end()) {
-                            return exp;
+                        auto val = this->getSymbolValue(exp);
+                        if (!val.isBound()) {
+                            Value &symbol = this->symbolValues[exp.symbol];
+                            if (!symbol.isBound()) symbol = this->heap.makeSymbol(string(exp.symbolValue));
+                            return symbol;
                         }
-                        return val->second;
+                        return val;
                     }
                     default:
-                        return exp;
-                        break;
-                }
-                if (this->stack.empty()) {
-                    return this->getNone();
+                        return this->heap.fromExpression(exp);
                 }
-                auto result = this->stack.top();
-                this->stack.pop();
-                return result;
-            }
-
-            Expression executeExpression(Expression exp) {
-                return this->executeExpression(exp, this->environment);
             }
     };
 }
\ No newline at end of file
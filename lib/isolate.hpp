@@ -0,0 +1,207 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "textfile.hpp"
+#include "parser.hpp"
+#include "resolver.hpp"
+#include "compiler.hpp"
+#include "natives.hpp"
+#include "optimizer.hpp"
+#include "interpreter.hpp"
+#include "vm.hpp"
+#include "actors.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    // A program prepared once for any number of isolates: parsed, optimized, resolved and compiled. Nothing in
+    // it changes afterwards, so isolates on different threads share it without locking. Host builtins must be
+    // in `natives` when the script is compiled; heap and depth settings may be changed until it is shared.
+    class Script {
+        public:
+            ParseResult ast;        // resolved, for the interpreter
+            uint sites;             // call sites the Resolver numbered in `ast`
+            shared_ptr<const Program> program;  // compiled, for the VM
+            Natives natives;
+            HeapOptions heap;       // for the heaps of isolates running the script
+            uint maxDepth;
+
+            static shared_ptr<Script> compile (shared_ptr<Textfile> file, const Natives &natives = Natives::standard(), bool optimizing = true) {
+                auto script = make_shared<Script>();
+                script->ast = Parser::parse(Parser::getTokens(file->getView()), file);
+                script->natives = natives;
+                script->maxDepth = 5000;
+                if (optimizing) Optimizer(natives).optimize(script->ast);
+                script->sites = Resolver::resolve(script->ast);
+                script->program = make_shared<const Program>(Compiler::compile(script->ast, natives.names));
+                return script;
+            }
+
+            static shared_ptr<Script> compile (const string &source, const Natives &natives = Natives::standard(), bool optimizing = true) {
+                return Script::compile(make_shared<Textfile>(source), natives, optimizing);
+            }
+    };
+
+    struct IsolateResult {
+        string output;  // what the script printed, errors included
+        bool failed;    // the run ended with an error
+    };
+
+    // One engine running a Script, with its own heap, output and actors, so isolates can run on different
+    // threads at the same time. An isolate itself is used by one thread at a time.
+    // run() executes the whole script from a clean slate. call() invokes a global function, running the top level
+    // first if this isolate has not yet; the bindings it made are kept for later calls, so functions defined there
+    // serve any number of requests without being set up again.
+    template<typename Engine>
+    class Isolate {
+        public:
+            shared_ptr<const Script> script;
+            unique_ptr<Engine> engine;
+            Scheduler scheduler;    // actors are run on one worker thread per isolate
+            ostringstream output;
+            size_t actors;          // kept by the last release; a run that makes more releases them
+            bool loaded;            // the top level has run since the last reset
+            size_t runs;
+
+            Isolate (shared_ptr<const Script> script) : scheduler(1) {
+                this->script = script;
+                if constexpr (is_same<Engine, VM>::value) {
+                    this->engine = make_unique<VM>();
+                    this->engine->natives = script->natives;
+                    // The bytecode is shared; linking makes the runtime values this VM's heap owns
+                    this->engine->use(*script->program, script->program);
+                } else {
+                    this->engine = make_unique<Interpreter>(script->ast.symbols);
+                    this->engine->natives = script->natives;
+                }
+                this->engine->heap.configure(script->heap);
+                this->engine->maxDepth = script->maxDepth;
+                this->engine->context.out = &this->output;
+                this->engine->context.scheduler = &this->scheduler;
+                this->actors = 0;
+                this->loaded = false;
+                this->runs = 0;
+            }
+
+            Isolate (const Isolate&) = delete;
+            Isolate &operator= (const Isolate&) = delete;
+
+            IsolateResult run () {
+                return this->perform([&]() { this->load(); });
+            }
+
+            IsolateResult call (const string &function, const vector<Portable> &args = {}) {
+                return this->perform([&]() {
+                    if (!this->loaded) this->load();
+                    int symbol = this->script->ast.symbols->find(function);
+                    Value callee = symbol < 0 ? Value::unbound() : this->engine->globals[symbol];
+                    if (!callee.isFunction()) throw RuntimeException("Undefined function " + function);
+                    vector<Value> values;
+                    for (auto &arg : args) values.push_back(arg.materialize(this->engine->heap));
+                    this->engine->invoke(callee, Arguments { values.data(), values.size() });
+                    this->scheduler.run(*this->engine);
+                });
+            }
+
+            // Runs the top level from a clean slate
+            void load () {
+                this->engine->reset();
+                this->scheduler.release({});
+                this->actors = 0;
+                this->loaded = false;
+                if constexpr (is_same<Engine, VM>::value) this->engine->run();
+                else this->engine->executeResolved(this->script->ast, this->script->sites);
+                this->scheduler.run(*this->engine);
+                this->loaded = true;
+            }
+
+            // Runs `body` with the output sink emptied and hands over what it printed
+            template<typename Body>
+            IsolateResult perform (Body body) {
+                IsolateResult result { "", false };
+                this->output.str("");
+                this->runs++;
+                try {
+                    body();
+                } catch (exception &e) {
+                    this->output << "Error: " << e.what() << "\n";
+                    result.failed = true;
+                }
+                // A run that made actors frees those the engine no longer reaches, e.g. any it did not store
+                if (this->scheduler.actors.size() > this->actors) {
+                    this->engine->collectGarbage(true);
+                    this->scheduler.release(this->engine->heap.actors);
+                    this->actors = this->scheduler.actors.size();
+                } else {
+                    this->scheduler.discard();
+                }
+                result.output = this->output.str();
+                return result;
+            }
+    };
+
+    // Isolates of one script for a multi-threaded host. Each request takes an idle isolate, or makes a new one
+    // when there is none, and gives it back afterwards, so later requests find heaps, call-site caches and the
+    // top level's bindings already set up. Only taking and returning isolates locks.
+    template<typename Engine>
+    class IsolatePool {
+        public:
+            shared_ptr<const Script> script;
+            mutex lock;
+            vector<unique_ptr<Isolate<Engine>>> idle;
+            size_t created;
+
+            IsolatePool (shared_ptr<const Script> script) {
+                this->script = script;
+                this->created = 0;
+            }
+
+            // Makes `count` isolates ahead of the first requests and runs their top level
+            void warm (size_t count) {
+                vector<unique_ptr<Isolate<Engine>>> isolates;
+                for (size_t i = 0; i < count; i++) {
+                    isolates.push_back(this->acquire());
+                    isolates.back()->run();
+                }
+                for (auto &isolate : isolates) this->release(move(isolate));
+            }
+
+            unique_ptr<Isolate<Engine>> acquire () {
+                {
+                    lock_guard<mutex> guard(this->lock);
+                    if (!this->idle.empty()) {
+                        auto isolate = move(this->idle.back());
+                        this->idle.pop_back();
+                        return isolate;
+                    }
+                    this->created++;
+                }
+                return make_unique<Isolate<Engine>>(this->script);
+            }
+
+            void release (unique_ptr<Isolate<Engine>> isolate) {
+                lock_guard<mutex> guard(this->lock);
+                this->idle.push_back(move(isolate));
+            }
+
+            IsolateResult run () {
+                auto isolate = this->acquire();
+                auto result = isolate->run();
+                this->release(move(isolate));
+                return result;
+            }
+
+            IsolateResult call (const string &function, const vector<Portable> &args = {}) {
+                auto isolate = this->acquire();
+                auto result = isolate->call(function, args);
+                this->release(move(isolate));
+                return result;
+            }
+    };
+}
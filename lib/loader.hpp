@@ -0,0 +1,122 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "textfile.hpp"
+#include "parser.hpp"
+#include "symbols.hpp"
+#include "arena.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    class LoaderException : public exception {
+        public:
+            string message;
+
+            LoaderException (string message) {
+                this->message = string("Loader Exception: " + message);
+            }
+
+            const char * what () const throw () {
+                return this->message.c_str();
+            }
+    };
+
+    // Loads a program made of several source files. Files are read, tokenized and parsed at the same time on a pool
+    // of threads, each into its own arena and symbol table. The tables are then merged in the order the files were
+    // given and every tree is renumbered to the merged ids, again in parallel, so references between files resolve
+    // like any other global. The result runs the files' top-level forms in that order.
+    // Errors do not depend on how the threads were scheduled: every file is parsed in full and failures are
+    // reported together, in file order.
+    class Loader {
+        public:
+            struct Unit {
+                string path;
+                ParseResult ast;
+                vector<uint> ids;   // merged symbol id of each of the unit's own
+                string error;
+            };
+
+            vector<Unit> units;
+            uint threads;           // 0 for one per core
+
+            Loader (const vector<string> &paths, uint threads = 0) {
+                for (auto &path : paths) this->units.push_back(Unit { path, ParseResult {}, {}, "" });
+                this->threads = threads;
+            }
+
+            static ParseResult load (const vector<string> &paths, uint threads = 0) {
+                return Loader(paths, threads).load();
+            }
+
+            ParseResult load () {
+                this->each([](Unit &unit) { Loader::parse(unit); });
+                string errors;
+                for (auto &unit : this->units) {
+                    if (!unit.error.empty()) errors += (errors.empty() ? "" : "\n") + unit.path + ": " + unit.error;
+                }
+                if (!errors.empty()) throw LoaderException(errors);
+
+                ParseResult result;
+                result.arena = make_shared<Arena>();
+                result.symbols = make_shared<SymbolTable>();
+                size_t count = 0;
+                for (auto &unit : this->units) {
+                    for (auto &name : unit.ast.symbols->names) unit.ids.push_back(result.symbols->intern(name));
+                    result.arena->retain(unit.ast.arena);
+                    count += unit.ast.expressions.size();
+                }
+                this->each([](Unit &unit) { Loader::renumber(unit.ast.expressions, unit.ids); });
+
+                vector<Expression> forms;
+                forms.reserve(count);
+                for (auto &unit : this->units) forms.insert(forms.end(), unit.ast.expressions.begin(), unit.ast.expressions.end());
+                result.expressions = Parser::store(*result.arena, forms.data(), forms.size());
+                return result;
+            }
+
+            static void parse (Unit &unit) {
+                try {
+                    auto file = Textfile::open(unit.path);
+                    unit.ast = Parser::parse(Parser::getTokens(file->getView()), file);
+                } catch (exception &e) {
+                    unit.error = e.what();
+                }
+            }
+
+            // Replaces the ids of the unit's symbol table with merged ones
+            static void renumber (const ExpressionList &expressions, const vector<uint> &ids) {
+                for (auto exp = expressions.begin(); exp != expressions.end(); ++exp) {
+                    if (exp->tag == ExpressionTag::SYMBOL || (exp->tag == ExpressionTag::CALL && !exp->callName.empty())) {
+                        exp->symbol = ids[exp->symbol];
+                    }
+                    if (exp->tag == ExpressionTag::CALL) Loader::renumber(exp->callValue, ids);
+                }
+            }
+
+            // Runs `work` for every unit on up to `threads` threads, each taking the next unit nobody has yet
+            template<typename Work>
+            void each (Work work) {
+                uint count = this->threads > 0 ? this->threads : max(1u, thread::hardware_concurrency());
+                count = min(count, (uint)this->units.size());
+                if (count <= 1) {
+                    for (auto &unit : this->units) work(unit);
+                    return;
+                }
+                atomic<size_t> next(0);
+                vector<thread> pool;
+                for (uint i = 0; i < count; i++) {
+                    pool.emplace_back([&]() {
+                        for (size_t index = next++; index < this->units.size(); index = next++) work(this->units[index]);
+                    });
+                }
+                for (auto &worker : pool) worker.join();
+            }
+    };
+}
@@ -0,0 +1,355 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "value.hpp"
+#include "heap.hpp"
+#include "format.hpp"
+#include "actors.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    class CollectionException : public exception {
+        public:
+            string message;
+
+            CollectionException (string message) {
+                this->message = string("Collection Exception: " + message);
+            }
+
+            const char * what () const throw () {
+                return this->message.c_str();
+            }
+    };
+
+    // What a native may touch besides its arguments
+    class NativeContext {
+        public:
+            Heap *heap;
+            ostream *out;
+            size_t calls;           // native calls made through this context
+            const void *site;       // identifies the call being made, set by the engine before each native call
+            FormatCache formats;
+            string text;            // scratch space for building output
+            Scheduler *scheduler;   // runs actors; null when the engine has none
+            std::function<Value(Value, Arguments)> apply;   // calls a script function; set by the engine
+
+            NativeContext (Heap *heap, ostream *out) {
+                this->heap = heap;
+                this->out = out;
+                this->calls = 0;
+                this->site = nullptr;
+                this->scheduler = nullptr;
+            }
+
+            // Calls `function` with the values of `args`, which must not point into the engine's stack, like the
+            // Arguments of the native making the call do; copy what is needed first
+            Value call (Value function, initializer_list<Value> args) {
+                if (!this->apply) throw CollectionException("Functions cannot be called here");
+                return this->apply(function, Arguments { args.begin(), args.size() });
+            }
+
+            Scheduler &getScheduler () {
+                if (this->scheduler == nullptr) throw ActorException("Actors are not available here");
+                return *this->scheduler;
+            }
+
+            // printf and sprintf: a string first argument is a format for the arguments after it, and whatever
+            // arguments the format did not use follow it as they are
+            void format (Arguments args) {
+                this->text.clear();
+                size_t next = 0;
+                if (!args.empty() && args[0].type == ValueType::STRING) {
+                    next = this->formats.get(this->site, args[0].asString()).write(this->text, args.items, args.count, 1);
+                }
+                for (; next < args.size(); next++) args[next].append(this->text);
+            }
+    };
+
+    typedef std::function<Value(NativeContext&, Arguments)> NativeFunction;
+
+    // Builtins callable from scripts, shared by the interpreter and the VM. Host code registers its own with
+    // define() before the program is compiled; `let` and `fn` are special forms and not listed here.
+    // A pure builtin only computes its result from its arguments, so the Optimizer may call it ahead of time.
+    class Natives {
+        public:
+            vector<string> names;
+            vector<NativeFunction> functions;
+            vector<bool> pure;
+            map<string, uint, less<>> index;
+
+            Natives () {}
+
+            uint define (const string &name, NativeFunction function, bool pure = false) {
+                auto found = this->index.find(name);
+                if (found != this->index.end()) {
+                    this->functions[found->second] = function;
+                    this->pure[found->second] = pure;
+                    return found->second;
+                }
+                uint id = this->names.size();
+                this->names.push_back(name);
+                this->functions.push_back(function);
+                this->pure.push_back(pure);
+                this->index.insert(pair<string, uint>(name, id));
+                return id;
+            }
+
+            int find (string_view name) const {
+                auto found = this->index.find(name);
+                if (found == this->index.end()) return -1;
+                return found->second;
+            }
+
+            static ListObject *getList (const Value &value, const char *name) {
+                if (value.type != ValueType::LIST) throw CollectionException(string(name) + " expects a list");
+                return value.asList();
+            }
+
+            static MapObject *getMap (const Value &value, const char *name) {
+                if (value.type != ValueType::MAP) throw CollectionException(string(name) + " expects a map");
+                return value.asMap();
+            }
+
+            static size_t getIndex (const Value &value, size_t size, const char *name) {
+                if (value.type != ValueType::NUMBER || value.as.number < 0) throw CollectionException(string(name) + " expects a position");
+                return min((size_t)value.as.number, size);
+            }
+
+            // Lists and maps. Lists are indexed from 0. Callbacks get an item and its position, or a key and its value.
+            // push and put change a collection in place. An actor gets its own copies of what its handlers close
+            // over, which keep their changes from one message to the next (see Actor); collections sent in a
+            // message are copies too, so the sender never sees what the receiver does to them.
+            static void defineCollections (Natives &natives) {
+                natives.define("list", [](NativeContext &context, Arguments args) {
+                    Value list = context.heap->makeList(args.size());
+                    list.asList()->items.assign(args.begin(), args.end());
+                    return list;
+                }, true);
+
+                natives.define("pair", [](NativeContext &context, Arguments args) {
+                    Value list = context.heap->makeList(2);
+                    list.asList()->items.push_back(args.size() > 0 ? args[0] : Value::none());
+                    list.asList()->items.push_back(args.size() > 1 ? args[1] : Value::none());
+                    return list;
+                }, true);
+
+                // (map (pair key value)...)
+                natives.define("map", [](NativeContext &context, Arguments args) {
+                    Value map = context.heap->makeMap(args.size());
+                    for (auto &arg : args) {
+                        if (arg.type != ValueType::LIST || arg.asList()->items.size() != 2) throw CollectionException("map expects pairs");
+                        map.asMap()->put(arg.asList()->items[0], arg.asList()->items[1]);
+                    }
+                    context.heap->update(map.asMap());
+                    return map;
+                }, true);
+
+                // (get collection position-or-key [default])
+                natives.define("get", [](NativeContext &, Arguments args) {
+                    Value missing = args.size() > 2 ? args[2] : Value::none();
+                    if (args.size() < 2) throw CollectionException("get expects a collection and a key");
+                    if (args[0].type == ValueType::MAP) {
+                        const Value *value = args[0].asMap()->get(args[1]);
+                        return value == nullptr ? missing : *value;
+                    }
+                    if (args[0].type != ValueType::LIST) throw CollectionException("get expects a list or a map");
+                    auto &items = args[0].asList()->items;
+                    if (args[1].type != ValueType::NUMBER || !(args[1].as.number >= 0 && args[1].as.number < items.size())) return missing;
+                    return items[(size_t)args[1].as.number];
+                }, true);
+
+                // (put map key value...): changes the map and returns it
+                natives.define("put", [](NativeContext &context, Arguments args) {
+                    if (args.empty() || args.size() % 2 != 1) throw CollectionException("put expects a map and pairs of key and value");
+                    MapObject *map = Natives::getMap(args[0], "put");
+                    for (size_t i = 1; i < args.size(); i += 2) map->put(args[i], args[i + 1]);
+                    context.heap->update(map);
+                    return args[0];
+                });
+
+                // (push list value...): appends to the list and returns it
+                natives.define("push", [](NativeContext &context, Arguments args) {
+                    if (args.empty()) throw CollectionException("push expects a list");
+                    ListObject *list = Natives::getList(args[0], "push");
+                    list->items.insert(list->items.end(), args.begin() + 1, args.end());
+                    context.heap->update(list);
+                    return args[0];
+                });
+
+                natives.define("length", [](NativeContext &, Arguments args) {
+                    if (args.empty()) throw CollectionException("length expects a collection");
+                    switch (args[0].type) {
+                        case ValueType::LIST: return Value::fromNumber(args[0].asList()->items.size());
+                        case ValueType::MAP: return Value::fromNumber(args[0].asMap()->entries.size());
+                        case ValueType::STRING: return Value::fromNumber(args[0].asString().size());
+                        default: throw CollectionException("length expects a collection");
+                    }
+                }, true);
+
+                natives.define("keys", [](NativeContext &context, Arguments args) {
+                    MapObject *map = Natives::getMap(args.empty() ? Value::none() : args[0], "keys");
+                    Value list = context.heap->makeList(map->entries.size());
+                    for (auto &entry : map->entries) list.asList()->items.push_back(entry.key);
+                    return list;
+                }, true);
+
+                natives.define("values", [](NativeContext &context, Arguments args) {
+                    MapObject *map = Natives::getMap(args.empty() ? Value::none() : args[0], "values");
+                    Value list = context.heap->makeList(map->entries.size());
+                    for (auto &entry : map->entries) list.asList()->items.push_back(entry.value);
+                    return list;
+                }, true);
+
+                // (range end) or (range start end): the whole numbers from start, or 0, up to but not including end
+                natives.define("range", [](NativeContext &context, Arguments args) {
+                    if (args.empty() || args.back().type != ValueType::NUMBER) throw CollectionException("range expects numbers");
+                    double start = args.size() > 1 && args[0].type == ValueType::NUMBER ? args[0].as.number : 0;
+                    double end = args.back().as.number;
+                    size_t count = end > start ? (size_t)ceil(end - start) : 0;
+                    if (count > (1u << 30)) throw CollectionException("range is too large");
+                    Value list = context.heap->makeList(count);
+                    for (size_t i = 0; i < count; i++) list.asList()->items.push_back(Value::fromNumber(start + i));
+                    return list;
+                }, true);
+
+                natives.define("concat", [](NativeContext &context, Arguments args) {
+                    size_t count = 0;
+                    for (auto &arg : args) count += Natives::getList(arg, "concat")->items.size();
+                    Value list = context.heap->makeList(count);
+                    for (auto &arg : args) {
+                        auto &items = arg.asList()->items;
+                        list.asList()->items.insert(list.asList()->items.end(), items.begin(), items.end());
+                    }
+                    return list;
+                }, true);
+
+                // (slice list start [end])
+                natives.define("slice", [](NativeContext &context, Arguments args) {
+                    if (args.size() < 2) throw CollectionException("slice expects a list and a position");
+                    auto &items = Natives::getList(args[0], "slice")->items;
+                    size_t start = Natives::getIndex(args[1], items.size(), "slice");
+                    size_t end = args.size() > 2 ? Natives::getIndex(args[2], items.size(), "slice") : items.size();
+                    Value list = context.heap->makeList(end > start ? end - start : 0);
+                    if (end > start) list.asList()->items.assign(items.begin() + start, items.begin() + end);
+                    return list;
+                }, true);
+
+                // Callbacks may change the collection; items added meanwhile are visited too
+                natives.define("for-each", [](NativeContext &context, Arguments args) {
+                    if (args.size() < 2) throw CollectionException("for-each expects a collection and a function");
+                    Value collection = args[0];
+                    Value function = args[1];
+                    if (collection.type == ValueType::MAP) {
+                        auto &entries = collection.asMap()->entries;
+                        for (size_t i = 0; i < entries.size(); i++) context.call(function, { entries[i].key, entries[i].value });
+                        return Value::none();
+                    }
+                    auto &items = Natives::getList(collection, "for-each")->items;
+                    for (size_t i = 0; i < items.size(); i++) context.call(function, { items[i], Value::fromNumber(i) });
+                    return Value::none();
+                });
+
+                // (transform collection function): a new list of the results, or a new map of the keys to them
+                natives.define("transform", [](NativeContext &context, Arguments args) {
+                    if (args.size() < 2) throw CollectionException("transform expects a collection and a function");
+                    Value collection = args[0];
+                    Value function = args[1];
+                    Pinned pinned(*context.heap);
+                    if (collection.type == ValueType::MAP) {
+                        auto &entries = collection.asMap()->entries;
+                        MapObject *result = pinned.add(context.heap->makeMap(entries.size())).asMap();
+                        for (size_t i = 0; i < entries.size(); i++) {
+                            Value key = entries[i].key;
+                            result->put(key, context.call(function, { key, entries[i].value }));
+                        }
+                        context.heap->update(result);
+                        return Value::fromObject(result);
+                    }
+                    auto &items = Natives::getList(collection, "transform")->items;
+                    ListObject *result = pinned.add(context.heap->makeList(items.size())).asList();
+                    for (size_t i = 0; i < items.size(); i++) result->items.push_back(context.call(function, { items[i], Value::fromNumber(i) }));
+                    context.heap->update(result);
+                    return Value::fromObject(result);
+                });
+
+                // (fold collection initial function): calls the function with the result so far and each item and
+                // position, or key and value, and returns the last result
+                natives.define("fold", [](NativeContext &context, Arguments args) {
+                    if (args.size() < 3) throw CollectionException("fold expects a collection, an initial value and a function");
+                    Value collection = args[0];
+                    Value function = args[2];
+                    Pinned pinned(*context.heap);
+                    size_t slot = context.heap->pinned.size();
+                    pinned.add(args[1]);
+                    if (collection.type == ValueType::MAP) {
+                        auto &entries = collection.asMap()->entries;
+                        for (size_t i = 0; i < entries.size(); i++) {
+                            Value result = context.call(function, { context.heap->pinned[slot], entries[i].key, entries[i].value });
+                            context.heap->pinned[slot] = result;
+                        }
+                        return context.heap->pinned[slot];
+                    }
+                    auto &items = Natives::getList(collection, "fold")->items;
+                    for (size_t i = 0; i < items.size(); i++) {
+                        Value result = context.call(function, { context.heap->pinned[slot], items[i], Value::fromNumber(i) });
+                        context.heap->pinned[slot] = result;
+                    }
+                    return context.heap->pinned[slot];
+                });
+            }
+
+            static Natives standard () {
+                Natives natives;
+
+                // Lines are not flushed one at a time; see OutputBuffer
+                natives.define("printf", [](NativeContext &context, Arguments args) {
+                    context.format(args);
+                    context.text += '\n';
+                    context.out->write(context.text.data(), context.text.size());
+                    return Value::none();
+                });
+
+                natives.define("sprintf", [](NativeContext &context, Arguments args) {
+                    context.format(args);
+                    return context.heap->makeString(context.text);
+                }, true);
+
+                natives.define("flush", [](NativeContext &context, Arguments) {
+                    context.out->flush();
+                    return Value::none();
+                });
+
+                natives.define("actor", [](NativeContext &context, Arguments args) {
+                    return context.getScheduler().spawn(args);
+                });
+
+                natives.define("send", [](NativeContext &context, Arguments args) {
+                    context.getScheduler().send(args);
+                    return Value::none();
+                });
+
+                natives.define("self", [](NativeContext &, Arguments) {
+                    if (Scheduler::self == nullptr) return Value::none();
+                    return Value::fromActor(Scheduler::self);
+                });
+
+                natives.define("return", [](NativeContext &, Arguments args) {
+                    if (args.empty()) return Value::none();
+                    return args.back();
+                }, true);
+
+                Natives::defineCollections(natives);
+
+                return natives;
+            }
+    };
+}
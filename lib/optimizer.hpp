@@ -0,0 +1,276 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "parser.hpp"
+#include "arena.hpp"
+#include "value.hpp"
+#include "heap.hpp"
+#include "natives.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    // Rewrites parsed forms before they are resolved and run:
+    //   - calls of pure builtins with constant arguments are replaced by their result,
+    //   - calls of small non-recursive global functions whose arguments are plain values are replaced by the body,
+    //   - expressions whose value is thrown away are dropped if they can neither fail nor be observed.
+    // There is no control flow in the language, so those discarded expressions are all the dead code there is.
+    // A pure builtin may still raise an error, e.g. `(length 5)`, so a discarded call is only dropped when
+    // folding already ran it without one; otherwise the engine has to make the call and raise it.
+    // Names are followed the way the Resolver will address them, so a local shadowing a global function is
+    // never inlined. Forms may be optimized one at a time, e.g. when streaming; functions defined by earlier
+    // forms stay known.
+    class Optimizer {
+        public:
+            // A global bound by a top-level `(let name (fn ...))` that no earlier form bound
+            struct Function {
+                const Expression *definition;   // the `fn` form
+                shared_ptr<Arena> arena;        // keeps the definition alive after its form is gone
+                uint arity;
+                bool inlinable;
+                vector<uint> names;             // globals the body refers to
+                uint required;                  // parameters up to this one are used by the body
+            };
+
+            struct Stats {
+                size_t folded;
+                size_t inlined;
+                size_t removed;
+            };
+
+            Natives natives;
+            Heap heap;                      // scratch space for builtins run ahead of time
+            NativeContext context;
+            map<uint, Function> functions;  // by symbol id
+            set<uint> bound;                // globals some top-level `let` has bound so far
+            vector<vector<uint>> scopes;    // names declared so far in each enclosing `fn`
+            vector<uint> expanding;         // functions being inlined, innermost last
+            set<const Expression*> ran;     // arguments of calls folding ran without an error, in the current form
+            shared_ptr<Arena> arena;        // of the form being optimized
+            uint maxSize;                   // nodes in an inlinable body
+            Stats stats;
+
+            Optimizer (const Natives &natives = Natives::standard()) : natives(natives), context(&heap, nullptr) {
+                this->maxSize = 16;
+                this->stats = Stats { 0, 0, 0 };
+            }
+
+            void optimize (ParseResult &ast) {
+                this->arena = ast.arena;
+                for (auto exp = ast.expressions.begin(); exp != ast.expressions.end(); ++exp) {
+                    const Expression *definition = this->getDefinition(*exp);
+                    this->optimizeExpression(*exp);
+                    if (definition != nullptr) this->define(exp->callValue[0].symbol, *definition);
+                }
+                ast.expressions = this->removeDiscarded(ast.expressions, 0);
+                this->ran.clear();
+                this->heap.collect([](Heap &) {});
+            }
+
+            // `(let name (fn ...))` at the top level, binding a name for the first time
+            const Expression *getDefinition (const Expression &exp) {
+                if (!this->isCall(exp, "let") || exp.callValue.size() < 2) return nullptr;
+                auto &name = exp.callValue[0];
+                if (name.tag != ExpressionTag::SYMBOL || this->bound.count(name.symbol) > 0) return nullptr;
+                if (!this->isCall(exp.callValue[1], "fn")) return nullptr;
+                return &exp.callValue[1];
+            }
+
+            bool isCall (const Expression &exp, string_view name) {
+                return exp.tag == ExpressionTag::CALL && exp.callName == name;
+            }
+
+            bool isConstant (const Expression &exp) {
+                return exp.tag == ExpressionTag::NUMBER || exp.tag == ExpressionTag::STRING;
+            }
+
+            bool isLocal (uint symbol) {
+                for (auto &scope : this->scopes) {
+                    if (find(scope.begin(), scope.end(), symbol) != scope.end()) return true;
+                }
+                return false;
+            }
+
+            // The global function a call invokes, if it is known and not shadowed
+            Function *getFunction (const Expression &call) {
+                if (call.callName.empty() || this->natives.find(call.callName) >= 0 || this->isLocal(call.symbol)) return nullptr;
+                auto found = this->functions.find(call.symbol);
+                return found == this->functions.end() ? nullptr : &found->second;
+            }
+
+            uint getParameterCount (const Expression &function) {
+                uint count = 0;
+                while (count < function.callValue.size() && function.callValue[count].tag == ExpressionTag::SYMBOL) count++;
+                return count;
+            }
+
+            void optimizeExpression (Expression &exp) {
+                if (exp.tag != ExpressionTag::CALL) return;
+                if (exp.callName == "fn") return this->optimizeFunction(exp);
+                if (exp.callName == "let") return this->optimizeLet(exp);
+                for (auto arg = exp.callValue.begin(); arg != exp.callValue.end(); ++arg) {
+                    this->optimizeExpression(*arg);
+                }
+                if (exp.callName.empty()) return;
+                int native = this->natives.find(exp.callName);
+                if (native >= 0) this->fold(exp, native);
+                else this->inlineCall(exp);
+            }
+
+            // Same order as the Resolver: the value first, then the name is declared
+            void optimizeLet (Expression &exp) {
+                if (exp.callValue.size() > 1) this->optimizeExpression(exp.callValue[1]);
+                if (exp.callValue.empty() || exp.callValue[0].tag != ExpressionTag::SYMBOL) return;
+                uint symbol = exp.callValue[0].symbol;
+                if (this->scopes.empty()) {
+                    this->bound.insert(symbol);
+                    return;
+                }
+                auto &scope = this->scopes.back();
+                if (find(scope.begin(), scope.end(), symbol) == scope.end()) scope.push_back(symbol);
+            }
+
+            void optimizeFunction (Expression &exp) {
+                uint parameters = this->getParameterCount(exp);
+                this->scopes.push_back({});
+                for (uint i = 0; i < exp.callValue.size(); i++) {
+                    if (i < parameters) this->scopes.back().push_back(exp.callValue[i].symbol);
+                    else this->optimizeExpression(exp.callValue[i]);
+                }
+                exp.callValue = this->removeDiscarded(exp.callValue, parameters);
+                this->scopes.pop_back();
+            }
+
+            // Drops expressions that cannot fail from `items`, except the first `keepFirst` and the last one, which is the value.
+            // What follows the kept prefix must not become a symbol, which would turn it into a parameter of a `fn`.
+            // `items` itself is returned when nothing is dropped, so the arena only grows for lists that shrink.
+            ExpressionList removeDiscarded (const ExpressionList &items, size_t keepFirst) {
+                vector<Expression> kept;
+                for (size_t i = 0; i < items.size(); i++) {
+                    bool removable = i >= keepFirst && i + 1 < items.size() && this->isSafe(items[i]);
+                    if (removable && !(kept.size() == keepFirst && items[i + 1].tag == ExpressionTag::SYMBOL)) {
+                        this->stats.removed++;
+                        continue;
+                    }
+                    kept.push_back(items[i]);
+                }
+                if (kept.size() == items.size()) return items;
+                return Parser::store(*this->arena, kept.data(), kept.size());
+            }
+
+            // Whether evaluating `exp` can neither fail nor be observed, other than through its value: literals,
+            // symbols, `fn` forms and calls of pure builtins that folding ran. Calls of script functions may
+            // always fail, e.g. by exceeding the call depth.
+            bool isSafe (const Expression &exp) {
+                if (exp.tag != ExpressionTag::CALL) return true;
+                if (exp.callName == "fn") return true;
+                return !exp.callValue.empty() && this->ran.count(exp.callValue.items) > 0;
+            }
+
+            // Runs a pure builtin whose arguments are all constants and keeps the result if it is a constant too.
+            // Other results, e.g. lists, are made again by the engine, but the call is known not to fail.
+            void fold (Expression &exp, int native) {
+                if (!this->natives.pure[native]) return;
+                vector<Value> args;
+                for (auto arg = exp.callValue.begin(); arg != exp.callValue.end(); ++arg) {
+                    if (!this->isConstant(*arg)) return;
+                    args.push_back(this->heap.fromExpression(*arg));
+                }
+                Value result;
+                try {
+                    result = this->natives.functions[native](this->context, Arguments { args.data(), args.size() });
+                } catch (exception &e) {
+                    // Left for the engine to raise when the call is actually made
+                    return;
+                }
+                if (result.type == ValueType::NUMBER) {
+                    exp = Expression { ExpressionTag::NUMBER, .numberValue = result.as.number, .line = exp.line };
+                } else if (result.type == ValueType::STRING) {
+                    exp = Expression { ExpressionTag::STRING, .stringValue = this->arena->copy(result.asString()), .line = exp.line };
+                } else {
+                    // The argument list identifies the call, since the node itself is copied around
+                    if (!exp.callValue.empty()) this->ran.insert(exp.callValue.items);
+                    return;
+                }
+                this->stats.folded++;
+            }
+
+            void define (uint symbol, const Expression &definition) {
+                Function function { &definition, this->arena, this->getParameterCount(definition), false, {}, 0 };
+                function.inlinable = definition.callValue.size() == function.arity + 1
+                    && this->inspect(function, definition.callValue.back(), symbol) <= this->maxSize;
+                this->functions.insert(pair<uint, Function>(symbol, function));
+            }
+
+            // Collects what inlining needs to know about `exp` in the body of `function` and returns its size in
+            // nodes, or more than maxSize if it cannot be moved to a call site: nested `let` and `fn` would be
+            // resolved in the caller's frame, and a parameter called as a function has no expression to stand for it
+            uint inspect (Function &function, const Expression &exp, uint self) {
+                const Expression &definition = *function.definition;
+                uint name = exp.symbol;
+                if (exp.tag == ExpressionTag::SYMBOL || (exp.tag == ExpressionTag::CALL && !exp.callName.empty())) {
+                    int parameter = -1;
+                    for (int i = function.arity - 1; i >= 0 && parameter < 0; i--) {
+                        if (definition.callValue[i].symbol == name) parameter = i;
+                    }
+                    if (parameter >= 0) {
+                        if (exp.tag == ExpressionTag::CALL) return this->maxSize + 1;
+                        function.required = max(function.required, (uint)parameter + 1);
+                    } else if (exp.tag == ExpressionTag::SYMBOL || this->natives.find(exp.callName) < 0) {
+                        if (exp.tag == ExpressionTag::CALL && (name == self || exp.callName == "let" || exp.callName == "fn")) {
+                            return this->maxSize + 1;
+                        }
+                        function.names.push_back(name);
+                    }
+                }
+                uint size = 1;
+                for (auto arg = exp.callValue.begin(); arg != exp.callValue.end() && size <= this->maxSize; ++arg) {
+                    size += this->inspect(function, *arg, self);
+                }
+                return size;
+            }
+
+            void inlineCall (Expression &exp) {
+                Function *function = this->getFunction(exp);
+                if (function == nullptr || !function->inlinable) return;
+                if (find(this->expanding.begin(), this->expanding.end(), exp.symbol) != this->expanding.end()) return;
+                if (exp.callValue.size() < function->required) return;
+                for (auto arg = exp.callValue.begin(); arg != exp.callValue.end(); ++arg) {
+                    if (arg->tag == ExpressionTag::CALL) return;
+                }
+                for (uint name : function->names) {
+                    if (this->isLocal(name)) return;
+                }
+                Expression body = this->substitute(function->definition->callValue.back(), *function, exp.callValue);
+                this->expanding.push_back(exp.symbol);
+                this->optimizeExpression(body);
+                this->expanding.pop_back();
+                exp = body;
+                this->stats.inlined++;
+            }
+
+            // Copies `exp` into the current arena with the parameters of `function` replaced by `args`
+            Expression substitute (const Expression &exp, const Function &function, const ExpressionList &args) {
+                const Expression &definition = *function.definition;
+                if (exp.tag == ExpressionTag::SYMBOL) {
+                    for (int i = function.arity - 1; i >= 0; i--) {
+                        if (definition.callValue[i].symbol == exp.symbol) return args[i];
+                    }
+                    return exp;
+                }
+                if (exp.tag != ExpressionTag::CALL) return exp;
+                vector<Expression> items;
+                for (auto arg = exp.callValue.begin(); arg != exp.callValue.end(); ++arg) {
+                    items.push_back(this->substitute(*arg, function, args));
+                }
+                Expression copy = exp;
+                copy.callValue = Parser::store(*this->arena, items.data(), items.size());
+                return copy;
+            }
+    };
+}
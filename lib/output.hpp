@@ -0,0 +1,94 @@
+#pragma once
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+namespace Deluxe {
+    // Takes over a stream, typically cout, and collects what is written to it in one large buffer that goes to
+    // the file descriptor when it fills up, on flush() and when the buffer is destroyed, which also gives the
+    // stream its previous buffer back. Everything written through the stream shares the buffer, so the order of
+    // program output and error messages is kept; only writes to other streams, like cerr, may overtake it.
+    class OutputBuffer : public streambuf {
+        public:
+            ostream &stream;
+            streambuf *previous;
+            int fd;
+            vector<char> buffer;
+            bool failed;
+
+            OutputBuffer (ostream &stream, int fd, size_t size = 256 * 1024) : stream(stream) {
+                this->fd = fd;
+                this->failed = false;
+                this->buffer.resize(size);
+                this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+                this->previous = stream.rdbuf(this);
+            }
+
+            OutputBuffer (const OutputBuffer&) = delete;
+            OutputBuffer &operator= (const OutputBuffer&) = delete;
+
+            ~OutputBuffer () {
+                this->drain();
+                this->stream.rdbuf(this->previous);
+            }
+
+            // Writes out everything buffered; false once a write has failed, e.g. on a closed pipe
+            bool drain () {
+                if (!this->writeAll(this->pbase(), this->pptr() - this->pbase())) this->failed = true;
+                this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+                return !this->failed;
+            }
+
+            bool writeAll (const char *data, size_t size) {
+                while (size > 0 && !this->failed) {
+                    ssize_t written = ::write(this->fd, data, size);
+                    if (written < 0) {
+                        if (errno == EINTR) continue;
+                        return false;
+                    }
+                    data += written;
+                    size -= written;
+                }
+                return !this->failed;
+            }
+
+        protected:
+            int sync () override {
+                return this->drain() ? 0 : -1;
+            }
+
+            int_type overflow (int_type ch) override {
+                if (!this->drain()) return traits_type::eof();
+                if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+                *this->pptr() = traits_type::to_char_type(ch);
+                this->pbump(1);
+                return ch;
+            }
+
+            // Writes larger than the buffer bypass it once what is buffered has gone out
+            streamsize xsputn (const char *data, streamsize size) override {
+                if (size <= this->epptr() - this->pptr()) {
+                    memcpy(this->pptr(), data, size);
+                    this->pbump(size);
+                    return size;
+                }
+                if (!this->drain()) return 0;
+                if ((size_t)size >= this->buffer.size()) {
+                    if (!this->writeAll(data, size)) {
+                        this->failed = true;
+                        return 0;
+                    }
+                    return size;
+                }
+                memcpy(this->pptr(), data, size);
+                this->pbump(size);
+                return size;
+            }
+    };
+}
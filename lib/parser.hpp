@@ -1,11 +1,18 @@
 #pragma once
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <charconv>
 
 #include <ctype.h>
 
+#include "arena.hpp"
+#include "scanner.hpp"
+#include "symbols.hpp"
+
 using namespace std;
 
 namespace Deluxe {
@@ -19,7 +26,7 @@ namespace Deluxe {
 
     struct SToken {
         TToken tokenType;
-        string content;
+        string_view content;
         uint line;
     };
 
@@ -48,18 +55,48 @@ namespace Deluxe {
 
     enum class ExpressionTag { SYMBOL, STRING, NUMBER, CALL };
 
+    struct Expression;
+
+    // View over child expressions stored contiguously in the parse arena
+    struct ExpressionList {
+        Expression *items = nullptr;
+        uint count = 0;
+
+        Expression *begin () const;
+        Expression *end () const;
+        Expression &operator[] (size_t index) const;
+        Expression &front () const;
+        Expression &back () const;
+        size_t size () const { return this->count; }
+        bool empty () const { return this->count == 0; }
+    };
+
+    // Parse tree node; text fields are slices owned by the ParseResult's arena
     struct Expression {
         ExpressionTag tag;
-        string stringValue;
-        string symbolValue;
+        string_view stringValue;
+        string_view symbolValue;
         double numberValue;
-        vector<Expression> callValue;
-        string callName;
+        ExpressionList callValue;
+        string_view callName;
+        uint symbol = 0;  // interned id of symbolValue or callName
+        int depth = -1;   // lexical address set by the Resolver: frames up from the current one, -1 for globals
+        uint slot = 0;    // slot within that frame; the frame size on `fn` forms
+        uint line = 0;    // source line of the token, or of the opening bracket for calls
+        ExpressionList captures;  // on `fn` forms: the outer variables the closure copies, addressed in the defining scope
+        uint site = 0;    // on calls: index of the call site, numbered by the Resolver
     };
 
+    inline Expression *ExpressionList::begin () const { return this->items; }
+    inline Expression *ExpressionList::end () const { return this->items + this->count; }
+    inline Expression &ExpressionList::operator[] (size_t index) const { return this->items[index]; }
+    inline Expression &ExpressionList::front () const { return this->items[0]; }
+    inline Expression &ExpressionList::back () const { return this->items[this->count - 1]; }
+
     struct ParseResult {
-        vector<Expression> expressions;
-        int index;
+        ExpressionList expressions;
+        shared_ptr<Arena> arena;  // also keeps the source alive when nodes slice into it
+        shared_ptr<SymbolTable> symbols;
     };
 
     class Parser {
@@ -90,133 +127,291 @@ namespace Deluxe {
                 }
             }
 
-            static vector<SToken> getTokens (string content) {
-                uint length = content.length();
+            static bool isDelimiter (char ch) {
+                return isspace((unsigned char)ch) || Parser::isBracket(ch) || ch == '"' || ch == ';';
+            }
+
+            // Same token stream as getTokensScalar, but runs of whitespace, symbol characters, string and comment
+            // bodies are skipped with the Scanner's vector kernels instead of one byte per iteration
+            static vector<SToken> getTokens (string_view content, const Scanner &scanner = Scanner::get()) {
+                const char *data = content.data();
+                size_t length = content.length();
                 uint line = 1;
-                uint col = 1;
+                size_t lineStart = 0;
                 vector<SToken> tokens;
-                string current;
+                tokens.reserve(length / 6);
 
-                TToken currentToken = Symbol;
-
-                for (uint i = 0; i < length; i++) {
-                    char ch(content[i]);
-                    col++;
+                size_t i = 0;
+                while (true) {
+                    i = scanner.skipBlank(data, i, length);
+                    if (i >= length) break;
+                    char ch(data[i]);
                     if (ch == '\n') {
-                        col = 0;
                         line++;
+                        lineStart = ++i;
+                        continue;
                     }
                     if (ch == ';') {
-                        while (ch != '\n') {
-                            i++;
-                            ch = content[i];
-                        }
-                        line++;
+                        auto newline = static_cast<const char*>(memchr(data + i, '\n', length - i));
+                        i = newline ? newline - data : length;
+                        continue;
                     }
                     if (ch == '"') {
-                        if (currentToken == String) {
-                            tokens.push_back({ currentToken, string(current), line });
-                            currentToken = Symbol;
-                            current.clear();
-                            continue;
-                        } else {
-                            currentToken = String;
-                            continue;
+                        size_t start = ++i;
+                        uint startLine = line;
+                        while ((i = scanner.findStringEnd(data, i, length)) < length && data[i] == '\n') {
+                            line++;
+                            lineStart = ++i;
                         }
+                        tokens.push_back({ String, content.substr(start, i - start), startLine });
+                        i++; // closing quote
+                        continue;
                     }
-                    if (currentToken == String) {
-                        current.push_back(ch);
+                    if (Parser::isBracket(ch)) {
+                        TToken bracket = (ch == '(' || ch == '[' || ch == '{') ? OpenBracket : CloseBracket;
+                        tokens.push_back({ bracket, content.substr(i, 1), line });
+                        i++;
                         continue;
                     }
-                    if (isspace(ch)) {
-                        if (!current.empty()) {
-                            tokens.push_back({ currentToken, string(current), line });
-                            currentToken = Symbol;
-                            current.clear();
+                    size_t start = i;
+                    i = scanner.findDelimiter(data, i, length);
+                    TToken currentToken = isdigit((unsigned char)ch) ? Number : Symbol;
+                    if (currentToken == Number) {
+                        for (size_t digit = start; digit < i; digit++) {
+                            if (!isdigit((unsigned char)data[digit]) && data[digit] != '.') {
+                                throw ParserException("Invalid number", line, digit - lineStart + 1);
+                            }
                         }
+                    }
+                    tokens.push_back({ currentToken, content.substr(start, i - start), line });
+                }
+                return tokens;
+            }
+
+            // Reference lexer, one byte at a time. Tokens are slices of `content`; string tokens exclude their quotes
+            static vector<SToken> getTokensScalar (string_view content) {
+                size_t length = content.length();
+                uint line = 1;
+                size_t lineStart = 0;
+                vector<SToken> tokens;
+
+                size_t i = 0;
+                while (i < length) {
+                    char ch(content[i]);
+                    if (ch == '\n') {
+                        line++;
+                        lineStart = ++i;
                         continue;
                     }
-                    if (Parser::isBracket(ch)) {
-                        if (!current.empty()) tokens.push_back({ currentToken, string(current), line });
-                        current.clear();
-                        current.push_back(ch);
-                        if (ch == '(' ||ch == '[' ||ch == '{') currentToken = OpenBracket;
-                        if (ch == ')' ||ch == ']' ||ch == '}') currentToken = CloseBracket;
-                        tokens.push_back({ currentToken, string(current), line });
-                        current.clear();
-                        currentToken = Symbol;
+                    if (isspace((unsigned char)ch)) {
+                        i++;
+                        continue;
+                    }
+                    if (ch == ';') {
+                        while (i < length && content[i] != '\n') i++;
                         continue;
                     }
-                    if (isdigit(ch)) {
-                        if (current.empty()) {
-                            currentToken = Number;
+                    if (ch == '"') {
+                        size_t start = ++i;
+                        uint startLine = line;
+                        while (i < length && content[i] != '"') {
+                            if (content[i] == '\n') {
+                                line++;
+                                lineStart = i + 1;
+                            }
+                            i++;
                         }
+                        tokens.push_back({ String, content.substr(start, i - start), startLine });
+                        i++; // closing quote
+                        continue;
+                    }
+                    if (Parser::isBracket(ch)) {
+                        TToken bracket = (ch == '(' || ch == '[' || ch == '{') ? OpenBracket : CloseBracket;
+                        tokens.push_back({ bracket, content.substr(i, 1), line });
+                        i++;
+                        continue;
                     }
-                    if (currentToken == Number && !isdigit(ch) && ch != '.') {
-                        // std::cout << "Error: digit expected" << endl;
-                        throw ParserException("Invalid number", line, col);
+                    size_t start = i;
+                    TToken currentToken = isdigit((unsigned char)ch) ? Number : Symbol;
+                    while (i < length && !Parser::isDelimiter(content[i])) {
+                        if (currentToken == Number && !isdigit((unsigned char)content[i]) && content[i] != '.') {
+                            throw ParserException("Invalid number", line, i - lineStart + 1);
+                        }
+                        i++;
                     }
-                    current.push_back(ch);
+                    tokens.push_back({ currentToken, content.substr(start, i - start), line });
                 }
-                if (!current.empty()) tokens.push_back({ currentToken, string(current), line }); // get last token
                 return tokens;
             }
 
-            static SToken expectSymbol(SToken token) {
+            static const SToken &expectSymbol(const SToken &token) {
                 if (token.tokenType != Symbol) throw ParserException("expected Symbol (got " + Parser::getTokenName(token.tokenType) + ")", token.line);
                 return token;
             }
 
-            static ParseResult parse(vector<SToken> tokens, string currentBracket = "") {
-                SToken current;
-                ParseResult result;
-                for(std::vector<SToken>::iterator it = std::begin(tokens); it != std::end(tokens); ++it) {
-                    current = *it;
-                    result.index = (int)std::distance(tokens.begin(), it);
-                    if (current.tokenType == OpenBracket) {
-                        string openingBracket = string(current.content);
-                        it++;
-                        auto dist = std::distance(tokens.begin(), it);
-                        current = Parser::expectSymbol(*it);
-                        auto tail = vector<SToken>(tokens.begin() + dist, tokens.end());
-                        ParseResult body = Parser::parse( tail, openingBracket );
-                        result.expressions.push_back(Expression {
-                            ExpressionTag::CALL,
-                            .callValue = vector<Expression>(body.expressions.begin() + 1, body.expressions.end()),
-                            .callName = body.expressions.front().symbolValue
-                        });
-                        it += body.index;
-                        continue; // TODO: Skip tail
-                    }
-                    if (current.tokenType == Symbol) {
-                        result.expressions.push_back(Expression {
-                            ExpressionTag::SYMBOL,
-                            .symbolValue = current.content
-                        });
-                    }
-                    if (current.tokenType == String) {
-                        result.expressions.push_back(Expression {
-                            ExpressionTag::STRING,
-                            .stringValue = current.content
-                        });
+            static char getClosingBracket (char open) {
+                switch (open) {
+                    case '(': return ')';
+                    case '[': return ']';
+                    default:
+                        return '}';
+                }
+            }
+
+            static ExpressionList store (Arena &arena, const Expression *items, size_t count) {
+                return ExpressionList { arena.copy(items, count), (uint)count };
+            }
+
+            // A class is a constructor for actors:
+            //   (class p... (on message q... body...)... other...)
+            // becomes
+            //   (fn p... other... (actor "message" (fn q... body...)...))
+            // so handlers close over the constructor's parameters and `let`s like any other function.
+            static Expression desugarClass (Arena &arena, SymbolTable &symbols, const Expression &form) {
+                vector<Expression> constructor;
+                vector<Expression> handlers;
+                size_t i = 0;
+                for (; i < form.callValue.size() && form.callValue[i].tag == ExpressionTag::SYMBOL; i++) {
+                    constructor.push_back(form.callValue[i]);
+                }
+                for (; i < form.callValue.size(); i++) {
+                    const Expression &item = form.callValue[i];
+                    // A bare symbol has no effect, and moved up to the parameters it would become one
+                    if (item.tag == ExpressionTag::SYMBOL) continue;
+                    if (item.tag != ExpressionTag::CALL || item.callName != "on") {
+                        constructor.push_back(item);
+                        continue;
                     }
-                    if (current.tokenType == Number) {
-                        result.expressions.push_back(Expression {
-                            ExpressionTag::NUMBER,
-                            .numberValue = std::stod(current.content)
-                        });
+                    if (item.callValue.empty() || item.callValue[0].tag != ExpressionTag::SYMBOL) {
+                        throw ParserException("Message name expected", item.line);
                     }
-                    if (current.tokenType == CloseBracket) {
-                        if (!currentBracket.empty()) {
-                            if (currentBracket == "(" && current.content != ")") throw ParserException("Expected closing bracket ')'", current.line);
-                            if (currentBracket == "[" && current.content != "]") throw ParserException("Expected closing bracket ']'", current.line);
-                            if (currentBracket == "{" && current.content != "}") throw ParserException("Expected closing bracket '}'", current.line);
+                    const Expression &message = item.callValue[0];
+                    handlers.push_back(Expression { ExpressionTag::STRING, .stringValue = message.symbolValue, .line = message.line });
+                    handlers.push_back(Expression {
+                        ExpressionTag::CALL,
+                        .callValue = ExpressionList { item.callValue.begin() + 1, item.callValue.count - 1 },
+                        .callName = "fn",
+                        .symbol = symbols.intern("fn"),
+                        .line = item.line
+                    });
+                }
+                constructor.push_back(Expression {
+                    ExpressionTag::CALL,
+                    .callValue = Parser::store(arena, handlers.data(), handlers.size()),
+                    .callName = "actor",
+                    .symbol = symbols.intern("actor"),
+                    .line = form.line
+                });
+                return Expression {
+                    ExpressionTag::CALL,
+                    .callValue = Parser::store(arena, constructor.data(), constructor.size()),
+                    .callName = "fn",
+                    .symbol = symbols.intern("fn"),
+                    .line = form.line
+                };
+            }
+
+            static double parseNumber (const SToken &token) {
+                double value = 0;
+                auto end = token.content.data() + token.content.size();
+                auto parsed = std::from_chars(token.content.data(), end, value);
+                if (parsed.ec != std::errc()) throw ParserException("Invalid number", token.line);
+                return value;
+            }
+
+            // Single pass over the tokens: children of every open bracket collect on one pending stack
+            // and move into the arena as one contiguous block when their bracket closes.
+            // With a `source` owning the tokens' text, nodes slice into it instead of copying.
+            // Passing `symbols` lets separately parsed forms share symbol ids.
+            static ParseResult parse(const vector<SToken> &tokens, shared_ptr<const void> source = nullptr, shared_ptr<SymbolTable> symbols = nullptr) {
+                struct OpenForm { char bracket; size_t start; uint line; };
+
+                ParseResult result;
+                // A call is one node with its name, so there is a node per token other than brackets. A small form,
+                // e.g. one streamed at a time, gets a first block its own size instead of the default one.
+                size_t estimate = 64;
+                for (auto &token : tokens) {
+                    if (token.tokenType == OpenBracket || token.tokenType == CloseBracket) continue;
+                    estimate += sizeof(Expression) + (source ? 0 : token.content.size());
+                }
+                result.arena = make_shared<Arena>(min(estimate, (size_t)4 * 1024));
+                result.symbols = symbols ? symbols : make_shared<SymbolTable>();
+                Arena &arena = *result.arena;
+                if (source) arena.retain(source);
+                auto text = [&](string_view content) { return source ? content : arena.copy(content); };
+                vector<Expression> pending;
+                vector<OpenForm> open;
+
+                for (size_t i = 0; i < tokens.size(); i++) {
+                    const SToken &current = tokens[i];
+                    switch (current.tokenType) {
+                        case OpenBracket: {
+                            if (i + 1 >= tokens.size()) throw ParserException("expected Symbol (got end of input)", current.line);
+                            Parser::expectSymbol(tokens[i + 1]);
+                            open.push_back(OpenForm { current.content[0], pending.size(), current.line });
+                            break;
+                        }
+                        case CloseBracket: {
+                            if (open.empty()) throw ParserException("Unexpected closing bracket '" + string(current.content) + "'", current.line);
+                            auto form = open.back();
+                            char expected = Parser::getClosingBracket(form.bracket);
+                            if (current.content[0] != expected) throw ParserException(string("Expected closing bracket '") + expected + "'", current.line);
+                            const Expression &head = pending[form.start];
+                            Expression call {
+                                ExpressionTag::CALL,
+                                .callValue = Parser::store(arena, pending.data() + form.start + 1, pending.size() - form.start - 1),
+                                .callName = head.symbolValue,
+                                .symbol = head.symbol,
+                                .line = form.line
+                            };
+                            if (call.callName == "class") call = Parser::desugarClass(arena, *result.symbols, call);
+                            pending.resize(form.start);
+                            open.pop_back();
+                            if (call.callName == "module") {
+                                // (module name forms...) only groups forms: they are run as top-level forms
+                                // and their bindings are globals, visible to every other module
+                                if (!open.empty()) throw ParserException("Modules must be at the top level", call.line);
+                                if (call.callValue.empty() || call.callValue[0].tag != ExpressionTag::SYMBOL) {
+                                    throw ParserException("Module name expected", call.line);
+                                }
+                                pending.insert(pending.end(), call.callValue.begin() + 1, call.callValue.end());
+                                break;
+                            }
+                            pending.push_back(call);
+                            break;
+                        }
+                        case Symbol: {
+                            pending.push_back(Expression {
+                                ExpressionTag::SYMBOL,
+                                .symbolValue = text(current.content),
+                                .symbol = result.symbols->intern(current.content),
+                                .line = current.line
+                            });
+                            break;
+                        }
+                        case String: {
+                            pending.push_back(Expression {
+                                ExpressionTag::STRING,
+                                .stringValue = text(current.content),
+                                .line = current.line
+                            });
+                            break;
+                        }
+                        case Number: {
+                            pending.push_back(Expression {
+                                ExpressionTag::NUMBER,
+                                .numberValue = Parser::parseNumber(current),
+                                .line = current.line
+                            });
+                            break;
                         }
-                        break;
                     }
-                    
                 }
+                if (!open.empty()) {
+                    throw ParserException(string("Expected closing bracket '") + Parser::getClosingBracket(open.back().bracket) + "'", open.back().line);
+                }
+                result.expressions = Parser::store(arena, pending.data(), pending.size());
                 return result;
             }
     };
-}
+}
\ No newline at end of file
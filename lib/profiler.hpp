@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+using namespace std;
+
+namespace Deluxe {
+    // Call counts and wall time per builtin call site and per user function, recorded by an engine running
+    // with a profiler attached. Calls are also kept as a call tree, so exclusive time per call path can be
+    // written as folded stacks ("main;f:3;printf:4 1234") for flamegraph tools.
+    class Profiler {
+        public:
+            struct Entry {
+                string name;
+                bool builtin;
+                uint line;          // definition of a user function, call site of a builtin
+                size_t calls;
+                uint active;        // recursion depth, so recursive calls count their time once
+                double inclusive;   // nanoseconds
+                double exclusive;
+            };
+
+            struct Node {
+                uint entry;
+                uint parent;
+                double exclusive;
+                map<uint, uint> children;   // entry -> node
+            };
+
+            struct Active {
+                uint node;
+                chrono::steady_clock::time_point start;
+                double children;
+            };
+
+            vector<Entry> entries;
+            map<tuple<bool, string, uint>, uint> index;
+            vector<Node> nodes;     // nodes[0] is the root of the call tree
+            vector<Active> active;
+
+            Profiler () {
+                this->nodes.push_back(Node { 0, 0, 0 });
+            }
+
+            uint entry (bool builtin, string_view name, uint line) {
+                auto key = make_tuple(builtin, string(name), line);
+                auto found = this->index.find(key);
+                if (found != this->index.end()) return found->second;
+                uint id = this->entries.size();
+                this->entries.push_back(Entry { string(name), builtin, line, 0, 0, 0, 0 });
+                this->index.insert(pair<tuple<bool, string, uint>, uint>(key, id));
+                return id;
+            }
+
+            void enter (uint entry) {
+                uint parent = this->active.empty() ? 0 : this->active.back().node;
+                auto child = this->nodes[parent].children.find(entry);
+                uint node;
+                if (child != this->nodes[parent].children.end()) {
+                    node = child->second;
+                } else {
+                    node = this->nodes.size();
+                    this->nodes.push_back(Node { entry, parent, 0 });
+                    this->nodes[parent].children.insert(pair<uint, uint>(entry, node));
+                }
+                this->entries[entry].calls++;
+                this->entries[entry].active++;
+                this->active.push_back(Active { node, chrono::steady_clock::now(), 0 });
+            }
+
+            void exit () {
+                auto call = this->active.back();
+                this->active.pop_back();
+                double elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - call.start).count();
+                Node &node = this->nodes[call.node];
+                Entry &entry = this->entries[node.entry];
+                node.exclusive += elapsed - call.children;
+                entry.exclusive += elapsed - call.children;
+                if (--entry.active == 0) entry.inclusive += elapsed;
+                if (!this->active.empty()) this->active.back().children += elapsed;
+            }
+
+            // Closes the calls an exception escaped from, down to `depth` open calls
+            void unwind (size_t depth) {
+                while (this->active.size() > depth) this->exit();
+            }
+
+            string getLabel (const Entry &entry) const {
+                return entry.name + ":" + to_string(entry.line);
+            }
+
+            // Flat profile, most expensive exclusive time first
+            void report (ostream &out) const {
+                vector<uint> order;
+                for (uint i = 0; i < this->entries.size(); i++) order.push_back(i);
+                sort(order.begin(), order.end(), [&](uint a, uint b) {
+                    return this->entries[a].exclusive > this->entries[b].exclusive;
+                });
+                out << left << setw(10) << "kind" << setw(24) << "name" << right << setw(8) << "line" << setw(12) << "calls"
+                    << setw(16) << "inclusive ms" << setw(16) << "exclusive ms" << endl;
+                for (uint id : order) {
+                    auto &entry = this->entries[id];
+                    out << left << setw(10) << (entry.builtin ? "builtin" : "fn") << setw(24) << entry.name << right
+                        << setw(8) << entry.line << setw(12) << entry.calls << fixed << setprecision(3)
+                        << setw(16) << entry.inclusive / 1e6 << setw(16) << entry.exclusive / 1e6 << endl;
+                }
+            }
+
+            // One line per call path: frames from the outermost call separated by ';', then exclusive nanoseconds
+            void writeFolded (ostream &out) const {
+                for (uint i = 1; i < this->nodes.size(); i++) {
+                    auto &node = this->nodes[i];
+                    long nanos = (long)node.exclusive;
+                    if (nanos <= 0) continue;
+                    string path;
+                    for (uint n = i; n != 0; n = this->nodes[n].parent) {
+                        string label = this->getLabel(this->entries[this->nodes[n].entry]);
+                        path = path.empty() ? label : label + ";" + path;
+                    }
+                    out << "main;" << path << " " << nanos << endl;
+                }
+            }
+    };
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include <vector>
+
+#include "parser.hpp"
+#include "arena.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    // Annotates symbol references with lexical (depth, slot) addresses.
+    // Every `fn` opens a frame: its arguments take the first slots, `let` inside the body adds further slots.
+    // A variable of an enclosing `fn` becomes a capture of every function between its frame and the use:
+    // depth 0 addresses a slot of the current frame, depth 1 a capture of the running closure, -1 a global.
+    // References resolve in evaluation order, so a name used before its `let` still refers to the outer binding.
+    class Resolver {
+        public:
+            struct Scope {
+                vector<uint> locals;            // symbol per slot
+                vector<Expression> captures;    // references resolved in the enclosing scope
+            };
+
+            vector<Scope> scopes;
+            Arena *arena;
+            vector<Expression*> inside;         // calls inside some `fn`
+            vector<Expression*> outside;        // calls outside any `fn`
+
+            Resolver (Arena *arena) {
+                this->arena = arena;
+            }
+
+            // Call sites are numbered from `firstSite`, so forms resolved one after another get distinct
+            // numbers; returns the number after the last one used
+            static uint resolve (ParseResult &ast, uint firstSite = 0) {
+                Resolver resolver = Resolver::scan(ast);
+                uint site = firstSite;
+                for (auto exp : resolver.inside) exp->site = site++;
+                for (auto exp : resolver.outside) exp->site = site++;
+                return site;
+            }
+
+            // Resolves the names of `ast` and collects its calls, leaving the caller to number them. Only
+            // functions can run once the forms are done, so a caller running one form after another may give
+            // the calls outside them sites it hands to the next form again.
+            static Resolver scan (ParseResult &ast) {
+                Resolver resolver(ast.arena.get());
+                for (auto exp = ast.expressions.begin(); exp != ast.expressions.end(); ++exp) {
+                    resolver.resolveExpression(*exp);
+                }
+                return resolver;
+            }
+
+            void lookup (Expression &exp) {
+                exp.depth = -1;
+                exp.slot = 0;
+                if (this->scopes.empty()) return;
+                this->find(this->scopes.size() - 1, exp);
+            }
+
+            // Resolves `exp` as seen from scopes[level], adding captures on the way out as needed
+            bool find (size_t level, Expression &exp) {
+                auto &scope = this->scopes[level];
+                for (int slot = scope.locals.size() - 1; slot >= 0; slot--) {
+                    if (scope.locals[slot] != exp.symbol) continue;
+                    exp.depth = 0;
+                    exp.slot = slot;
+                    return true;
+                }
+                for (uint index = 0; index < scope.captures.size(); index++) {
+                    if (scope.captures[index].symbol != exp.symbol) continue;
+                    exp.depth = 1;
+                    exp.slot = index;
+                    return true;
+                }
+                if (level == 0) return false;
+                Expression capture {
+                    ExpressionTag::SYMBOL,
+                    .symbolValue = exp.tag == ExpressionTag::CALL ? exp.callName : exp.symbolValue,
+                    .symbol = exp.symbol,
+                    .line = exp.line
+                };
+                if (!this->find(level - 1, capture)) return false;
+                exp.depth = 1;
+                exp.slot = this->scopes[level].captures.size();
+                this->scopes[level].captures.push_back(capture);
+                return true;
+            }
+
+            void declare (Expression &exp) {
+                auto &scope = this->scopes.back().locals;
+                exp.depth = 0;
+                for (uint slot = 0; slot < scope.size(); slot++) {
+                    if (scope[slot] != exp.symbol) continue;
+                    exp.slot = slot;
+                    return;
+                }
+                exp.slot = scope.size();
+                scope.push_back(exp.symbol);
+            }
+
+            void resolveExpression (Expression &exp) {
+                if (exp.tag == ExpressionTag::SYMBOL) return this->lookup(exp);
+                if (exp.tag != ExpressionTag::CALL) return;
+                if (this->scopes.empty()) this->outside.push_back(&exp);
+                else this->inside.push_back(&exp);
+
+                if (exp.callName == "fn") return this->resolveFunction(exp);
+                if (exp.callName == "let") return this->resolveLet(exp);
+
+                this->lookup(exp);
+                for (auto arg = exp.callValue.begin(); arg != exp.callValue.end(); ++arg) {
+                    this->resolveExpression(*arg);
+                }
+            }
+
+            void resolveFunction (Expression &exp) {
+                this->scopes.push_back({});
+                auto param = exp.callValue.begin();
+                for (; param != exp.callValue.end() && param->tag == ExpressionTag::SYMBOL; ++param) {
+                    param->depth = 0;
+                    param->slot = this->scopes.back().locals.size();
+                    this->scopes.back().locals.push_back(param->symbol);
+                }
+                for (; param != exp.callValue.end(); ++param) {
+                    this->resolveExpression(*param);
+                }
+                auto &scope = this->scopes.back();
+                exp.slot = scope.locals.size();
+                exp.captures = ExpressionList { this->arena->copy(scope.captures.data(), scope.captures.size()), (uint)scope.captures.size() };
+                this->scopes.pop_back();
+            }
+
+            void resolveLet (Expression &exp) {
+                if (exp.callValue.size() > 1) this->resolveExpression(exp.callValue[1]);
+                if (exp.callValue.empty() || exp.callValue[0].tag != ExpressionTag::SYMBOL) return;
+                if (this->scopes.empty()) {
+                    exp.callValue[0].depth = -1;
+                    return;
+                }
+                this->declare(exp.callValue[0]);
+            }
+    };
+}
@@ -0,0 +1,214 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#define DELUXE_SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace Deluxe {
+    enum class ScanLevel { SCALAR, SSE2, AVX2 };
+
+    // Byte-class search kernels used by the lexer. Each returns the first index >= i (or n) where the class
+    // condition holds; the vector versions test 16 or 32 bytes per step and finish the tail with the scalar loop.
+    //   skipBlank:     first byte that is not a space/tab/\v/\f/\r (newlines stop the skip so lines get counted)
+    //   findDelimiter: first whitespace, bracket, quote or comment start, i.e. the end of a symbol or number
+    //   findStringEnd: first closing quote or newline inside a string literal
+    class Scanner {
+        public:
+            typedef size_t (*Kernel)(const char *data, size_t i, size_t n);
+
+            ScanLevel level;
+            Kernel skipBlank;
+            Kernel findDelimiter;
+            Kernel findStringEnd;
+
+            Scanner (ScanLevel level) {
+                this->level = level;
+                this->skipBlank = Scanner::skipBlankScalar;
+                this->findDelimiter = Scanner::findDelimiterScalar;
+                this->findStringEnd = Scanner::findStringEndScalar;
+#ifdef DELUXE_SCANNER_X86
+                if (level == ScanLevel::SSE2) {
+                    this->skipBlank = Scanner::skipBlankSSE2;
+                    this->findDelimiter = Scanner::findDelimiterSSE2;
+                    this->findStringEnd = Scanner::findStringEndSSE2;
+                }
+                if (level == ScanLevel::AVX2) {
+                    this->skipBlank = Scanner::skipBlankAVX2;
+                    this->findDelimiter = Scanner::findDelimiterAVX2;
+                    this->findStringEnd = Scanner::findStringEndAVX2;
+                }
+#endif
+            }
+
+            // SSE2 even where AVX2 is supported: most runs the lexer scans end within a few bytes, where the
+            // wider step only costs more (make bench-lexer measures both)
+            static ScanLevel detect () {
+#ifdef DELUXE_SCANNER_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("sse2")) return ScanLevel::SSE2;
+#endif
+                return ScanLevel::SCALAR;
+            }
+
+            static bool isSupported (ScanLevel level) {
+                if (level == ScanLevel::SCALAR) return true;
+#ifdef DELUXE_SCANNER_X86
+                if (level == ScanLevel::SSE2) return __builtin_cpu_supports("sse2");
+                if (level == ScanLevel::AVX2) return __builtin_cpu_supports("avx2");
+#endif
+                return false;
+            }
+
+            static const char *getLevelName (ScanLevel level) {
+                switch (level) {
+                    case ScanLevel::SSE2: return "sse2";
+                    case ScanLevel::AVX2: return "avx2";
+                    default:
+                        return "scalar";
+                }
+            }
+
+            // The fastest kernels this CPU supports, chosen once
+            static const Scanner &get () {
+                static const Scanner scanner(Scanner::detect());
+                return scanner;
+            }
+
+            static bool isBlank (char ch) {
+                return ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f' || ch == '\r';
+            }
+
+            static bool isDelimiter (char ch) {
+                switch (ch) {
+                    case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+                    case '(': case ')': case '[': case ']': case '{': case '}':
+                    case '"': case ';':
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            static size_t skipBlankScalar (const char *data, size_t i, size_t n) {
+                while (i < n && Scanner::isBlank(data[i])) i++;
+                return i;
+            }
+
+            static size_t findDelimiterScalar (const char *data, size_t i, size_t n) {
+                while (i < n && !Scanner::isDelimiter(data[i])) i++;
+                return i;
+            }
+
+            static size_t findStringEndScalar (const char *data, size_t i, size_t n) {
+                while (i < n && data[i] != '"' && data[i] != '\n') i++;
+                return i;
+            }
+
+#ifdef DELUXE_SCANNER_X86
+            // \t \v \f \r are 0x09, 0x0B, 0x0C, 0x0D: test the 0x09..0x0D range and exclude \n
+            static __m128i blankMask16 (__m128i v) {
+                __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(0x09));
+                __m128i inRange = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(4)), offset);
+                __m128i control = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), inRange);
+                return _mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+            }
+
+            static __m128i delimiterMask16 (__m128i v) {
+                __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(0x09));
+                __m128i mask = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(4)), offset);
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+                mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+                return _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+            }
+
+            static size_t skipBlankSSE2 (const char *data, size_t i, size_t n) {
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                    uint32_t other = ~_mm_movemask_epi8(Scanner::blankMask16(v)) & 0xFFFF;
+                    if (other) return i + __builtin_ctz(other);
+                }
+                return Scanner::skipBlankScalar(data, i, n);
+            }
+
+            static size_t findDelimiterSSE2 (const char *data, size_t i, size_t n) {
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                    uint32_t found = _mm_movemask_epi8(Scanner::delimiterMask16(v));
+                    if (found) return i + __builtin_ctz(found);
+                }
+                return Scanner::findDelimiterScalar(data, i, n);
+            }
+
+            static size_t findStringEndSSE2 (const char *data, size_t i, size_t n) {
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                    __m128i mask = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+                    uint32_t found = _mm_movemask_epi8(mask);
+                    if (found) return i + __builtin_ctz(found);
+                }
+                return Scanner::findStringEndScalar(data, i, n);
+            }
+
+            __attribute__((target("avx2"))) static __m256i blankMask32 (__m256i v) {
+                __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(0x09));
+                __m256i inRange = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(4)), offset);
+                __m256i control = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), inRange);
+                return _mm256_or_si256(control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+            }
+
+            __attribute__((target("avx2"))) static __m256i delimiterMask32 (__m256i v) {
+                __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(0x09));
+                __m256i mask = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(4)), offset);
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+                mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+                return _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+            }
+
+            __attribute__((target("avx2"))) static size_t skipBlankAVX2 (const char *data, size_t i, size_t n) {
+                for (; i + 32 <= n; i += 32) {
+                    __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+                    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(Scanner::blankMask32(v));
+                    if (other) return i + __builtin_ctz(other);
+                }
+                return Scanner::skipBlankSSE2(data, i, n);
+            }
+
+            __attribute__((target("avx2"))) static size_t findDelimiterAVX2 (const char *data, size_t i, size_t n) {
+                for (; i + 32 <= n; i += 32) {
+                    __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+                    uint32_t found = _mm256_movemask_epi8(Scanner::delimiterMask32(v));
+                    if (found) return i + __builtin_ctz(found);
+                }
+                return Scanner::findDelimiterSSE2(data, i, n);
+            }
+
+            __attribute__((target("avx2"))) static size_t findStringEndAVX2 (const char *data, size_t i, size_t n) {
+                for (; i + 32 <= n; i += 32) {
+                    __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+                    __m256i mask = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+                    uint32_t found = _mm256_movemask_epi8(mask);
+                    if (found) return i + __builtin_ctz(found);
+                }
+                return Scanner::findStringEndSSE2(data, i, n);
+            }
+#endif
+    };
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "parser.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    // Resumable front end: input arrives in arbitrary chunks and every top-level form is handed out
+    // as its own ParseResult as soon as it is complete. Only the unfinished tail of the input is buffered,
+    // so memory is bounded by the largest single form. All forms share one SymbolTable.
+    class FormReader {
+        public:
+            string buffer;
+            size_t start;       // first byte of buffer not handed out yet
+            size_t scanned;     // bytes of buffer already classified
+            uint depth;
+            bool inString;
+            bool inComment;
+            bool inAtom;
+            uint line;          // line number of buffer[start]
+            shared_ptr<SymbolTable> symbols;
+
+            FormReader () {
+                this->start = 0;
+                this->scanned = 0;
+                this->depth = 0;
+                this->inString = false;
+                this->inComment = false;
+                this->inAtom = false;
+                this->line = 1;
+                this->symbols = make_shared<SymbolTable>();
+            }
+
+            // Consumed input is dropped once per chunk rather than once per form
+            void feed (string_view chunk) {
+                this->buffer.erase(0, this->start);
+                this->scanned -= this->start;
+                this->start = 0;
+                this->buffer.append(chunk.data(), chunk.size());
+            }
+
+            // Extracts the next complete top-level form, if the buffered input holds one
+            bool next (ParseResult &form) {
+                size_t end = this->findFormEnd();
+                if (end == string::npos) return false;
+                form = this->take(end);
+                return true;
+            }
+
+            // At end of input whatever is left must parse on its own; unclosed forms raise a ParserException
+            bool finish (ParseResult &form) {
+                if (this->next(form)) return true;
+                bool pending = this->depth > 0 || this->inString || this->inAtom;
+                this->depth = 0;
+                this->inString = false;
+                this->inAtom = false;
+                this->inComment = false;
+                if (!pending) {
+                    this->discard(this->buffer.size());
+                    return false;
+                }
+                form = this->take(this->buffer.size());
+                return true;
+            }
+
+            // Tracks bracket depth outside strings and comments; a form ends at the bracket that returns to
+            // depth zero, a top-level atom at the delimiter that follows it
+            size_t findFormEnd () {
+                const char *data = this->buffer.data();
+                size_t length = this->buffer.size();
+                for (size_t i = this->scanned; i < length; i++) {
+                    char ch = data[i];
+                    if (this->inComment) {
+                        if (ch == '\n') this->inComment = false;
+                        continue;
+                    }
+                    if (this->inString) {
+                        if (ch != '"') continue;
+                        this->inString = false;
+                        if (this->depth == 0) return this->complete(i + 1);
+                        continue;
+                    }
+                    if (this->inAtom && Scanner::isDelimiter(ch)) {
+                        this->inAtom = false;
+                        return this->complete(i);
+                    }
+                    switch (ch) {
+                        case ';': { this->inComment = true; break; }
+                        case '"': { this->inString = true; break; }
+                        case '(': case '[': case '{': { this->depth++; break; }
+                        case ')': case ']': case '}': {
+                            // A stray closing bracket is handed to the parser, which reports it
+                            if (this->depth <= 1) {
+                                this->depth = 0;
+                                return this->complete(i + 1);
+                            }
+                            this->depth--;
+                            break;
+                        }
+                        default:
+                            if (this->depth == 0 && !Scanner::isDelimiter(ch)) this->inAtom = true;
+                    }
+                }
+                this->scanned = length;
+                // Between forms everything scanned is whitespace or comments and can go
+                if (this->depth == 0 && !this->inString && !this->inAtom) this->discard(length);
+                return string::npos;
+            }
+
+            void discard (size_t end) {
+                for (size_t i = this->start; i < end; i++) {
+                    if (this->buffer[i] == '\n') this->line++;
+                }
+                this->start = end;
+            }
+
+            size_t complete (size_t end) {
+                this->scanned = end;
+                return end;
+            }
+
+            // Parses buffer[start, end) and marks it consumed; the parse tree copies what it keeps
+            ParseResult take (size_t end) {
+                string_view text(this->buffer.data() + this->start, end - this->start);
+                uint firstLine = this->line;
+                this->discard(end);
+                auto tokens = Parser::getTokens(text);
+                for (auto &token : tokens) token.line += firstLine - 1;
+                return Parser::parse(tokens, nullptr, this->symbols);
+            }
+    };
+}
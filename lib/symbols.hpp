@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+
+using namespace std;
+
+namespace Deluxe {
+    // Maps every distinct symbol name of a program to a small, dense id
+    class SymbolTable {
+        public:
+            deque<string> names;
+            unordered_map<string_view, uint> ids;  // keys view into `names`, whose strings never move
+
+            SymbolTable () {}
+
+            SymbolTable (const SymbolTable&) = delete;
+            SymbolTable &operator= (const SymbolTable&) = delete;
+
+            uint intern (string_view name) {
+                auto found = this->ids.find(name);
+                if (found != this->ids.end()) return found->second;
+                uint id = this->names.size();
+                this->names.push_back(string(name));
+                this->ids.insert(pair<string_view, uint>(this->names.back(), id));
+                return id;
+            }
+
+            int find (string_view name) const {
+                auto found = this->ids.find(name);
+                if (found == this->ids.end()) return -1;
+                return found->second;
+            }
+
+            const string &name (uint id) const {
+                return this->names[id];
+            }
+
+            size_t size () const {
+                return this->names.size();
+            }
+    };
+}
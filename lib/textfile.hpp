@@ -1,32 +1,99 @@
 #pragma once
+#include <memory>
 #include <string>
+#include <string_view>
 #include <iostream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace std;
 
 namespace Deluxe {
+    class TextfileException : public exception {
+        public:
+            string message;
+
+            TextfileException (string message) {
+                this->message = string("Textfile Exception: " + message);
+            }
+
+            const char * what () const throw () {
+                return this->message.c_str();
+            }
+    };
+
+    // Script source: either memory-mapped from a file or held in memory.
+    // Tokens and parse trees slice into it, so it has to outlive them.
     class Textfile {
         public:
             string contents;
+            const char *data;
             uint length;
+            void *mapping;
+            size_t mappingLength;
         public:
             Textfile(const string content) {
                 this->contents = string(content);
+                this->mapping = nullptr;
+                this->mappingLength = 0;
+                this->data = this->contents.data();
                 this->length = this->contents.length();
             }
 
+            // Reads the whole stream in large blocks instead of line by line
             Textfile(istream &stream) {
-                string content;
-                while (std::getline(stream, content)) {
-                    this->contents.append(content);
-                    this->contents.append("\n"); // keep newline character
+                char buffer[64 * 1024];
+                while (stream.read(buffer, sizeof(buffer)) || stream.gcount() > 0) {
+                    this->contents.append(buffer, stream.gcount());
                 }
+                this->mapping = nullptr;
+                this->mappingLength = 0;
+                this->data = this->contents.data();
                 this->length = this->contents.length();
             }
 
+            Textfile(const Textfile&) = delete;
+            Textfile &operator= (const Textfile&) = delete;
+
+            ~Textfile() {
+                if (this->mapping != nullptr) munmap(this->mapping, this->mappingLength);
+            }
+
+            static shared_ptr<Textfile> open(const string &path) {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) throw TextfileException("Cannot open " + path);
+                struct stat info;
+                if (fstat(fd, &info) != 0) {
+                    ::close(fd);
+                    throw TextfileException("Cannot stat " + path);
+                }
+                auto file = make_shared<Textfile>(string());
+                if (info.st_size > 0) {
+                    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (mapping == MAP_FAILED) {
+                        ::close(fd);
+                        throw TextfileException("Cannot map " + path);
+                    }
+                    madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+                    file->mapping = mapping;
+                    file->mappingLength = info.st_size;
+                    file->data = static_cast<const char*>(mapping);
+                    file->length = info.st_size;
+                }
+                ::close(fd);
+                return file;
+            }
+
+            string_view getView () const {
+                return string_view(this->data, this->length);
+            }
+
             string getContents () {
-                string result(this->contents);
+                string result(this->data, this->length);
                 return result;
             }
     };
-};
\ No newline at end of file
+};
@@ -0,0 +1,322 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+
+#include "parser.hpp"
+#include "arena.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+
+    // UNBOUND marks empty global and `let` slots; it never reaches script code.
+    // Actors are owned by the Scheduler, not the Heap, so they can be shared between threads.
+    enum class ValueType : uint8_t { NONE, NUMBER, SYMBOL, STRING, FUNCTION, LIST, MAP, ACTOR, UNBOUND };
+
+    class Actor;
+
+    class Object {
+        public:
+            ValueType type;
+            bool marked;    // reached during the current collection
+            uint32_t size;  // bytes accounted to this object by the Heap
+
+            Object (ValueType type) {
+                this->type = type;
+                this->marked = false;
+                this->size = 0;
+            }
+
+            virtual ~Object () {}
+    };
+
+    class StringObject : public Object {
+        public:
+            string value;
+
+            StringObject (ValueType type, string value) : Object(type) {
+                this->value = value;
+            }
+    };
+
+    struct Value;
+
+    // A function is either a compiled prototype (VM) or a view of its resolved `fn` body (interpreter),
+    // plus the values of the outer variables it uses. Bindings never change once made, so copying
+    // them when the closure is created is indistinguishable from sharing the defining frame.
+    class FunctionObject : public Object {
+        public:
+            uint arity;
+            uint frameSize;
+            ExpressionList body;
+            shared_ptr<Arena> arena;
+            vector<Value> captures;
+            uint prototype;
+            uint line;  // of the defining `fn` form
+
+            FunctionObject (uint arity, uint frameSize, ExpressionList body, shared_ptr<Arena> arena) : Object(ValueType::FUNCTION) {
+                this->arity = arity;
+                this->frameSize = frameSize;
+                this->body = body;
+                this->arena = arena;
+                this->prototype = 0;
+                this->line = 0;
+            }
+
+            FunctionObject (uint prototype) : Object(ValueType::FUNCTION) {
+                this->arity = 0;
+                this->frameSize = 0;
+                this->prototype = prototype;
+                this->line = 0;
+            }
+    };
+
+    class ListObject;
+    class MapObject;
+
+    // Runtime values are 16 bytes and trivially copyable; strings, symbols, functions and collections live on the Heap
+    struct Value {
+        ValueType type;
+        union {
+            double number;
+            Object *object;
+            Actor *actor;
+        } as;
+
+        static Value none () {
+            Value value;
+            value.type = ValueType::NONE;
+            value.as.object = nullptr;
+            return value;
+        }
+
+        static Value unbound () {
+            Value value;
+            value.type = ValueType::UNBOUND;
+            value.as.object = nullptr;
+            return value;
+        }
+
+        static Value fromNumber (double number) {
+            Value value;
+            value.type = ValueType::NUMBER;
+            value.as.number = number;
+            return value;
+        }
+
+        static Value fromObject (Object *object) {
+            Value value;
+            value.type = object->type;
+            value.as.object = object;
+            return value;
+        }
+
+        static Value fromActor (Actor *actor) {
+            Value value;
+            value.type = ValueType::ACTOR;
+            value.as.actor = actor;
+            return value;
+        }
+
+        bool isNone () const { return this->type == ValueType::NONE; }
+        bool isFunction () const { return this->type == ValueType::FUNCTION; }
+        bool isBound () const { return this->type != ValueType::UNBOUND; }
+
+        const string &asString () const { return static_cast<StringObject*>(this->as.object)->value; }
+        FunctionObject *asFunction () const { return static_cast<FunctionObject*>(this->as.object); }
+        ListObject *asList () const;
+        MapObject *asMap () const;
+
+        // Shortest text that reads back as the same number
+        static void appendNumber (string &out, double number) {
+            char buffer[32];
+            auto result = to_chars(buffer, buffer + sizeof(buffer), number);
+            out.append(buffer, result.ptr - buffer);
+        }
+
+        // `depth` counts enclosing collections; a collection may contain itself
+        void append (string &out, uint depth = 0) const;
+
+        void print (ostream &out) const {
+            string text;
+            this->append(text);
+            out << text;
+        }
+    };
+
+    // Values in one contiguous array; numbers are stored in place, not as separate objects
+    class ListObject : public Object {
+        public:
+            vector<Value> items;
+
+            ListObject () : Object(ValueType::LIST) {}
+    };
+
+    // Insertion-ordered hash map: entries are kept in one array in the order they were added, found through an
+    // open-addressing table of their indexes (linear probing, at most half full). Symbols are interned by the
+    // Heap, so symbol keys are hashed and compared by address; strings by content, numbers by value.
+    class MapObject : public Object {
+        public:
+            struct Entry {
+                Value key;
+                Value value;
+                size_t hash;
+            };
+
+            vector<Entry> entries;
+            vector<int32_t> slots;  // indexes into `entries`, -1 when free; the size is a power of two
+
+            MapObject () : Object(ValueType::MAP) {}
+
+            static size_t hash (const Value &key) {
+                switch (key.type) {
+                    case ValueType::NUMBER: {
+                        double number = key.as.number == 0 ? 0 : key.as.number;  // -0 is the same key as 0
+                        uint64_t bits;
+                        memcpy(&bits, &number, sizeof(bits));
+                        return MapObject::mix(bits);
+                    }
+                    case ValueType::STRING: return std::hash<string>()(key.asString());
+                    case ValueType::NONE: return 0;
+                    default: return MapObject::mix((uint64_t)(uintptr_t)key.as.object);
+                }
+            }
+
+            static size_t mix (uint64_t bits) {
+                bits ^= bits >> 33;
+                bits *= 0xff51afd7ed558ccdULL;
+                bits ^= bits >> 33;
+                return (size_t)bits;
+            }
+
+            static bool equals (const Value &a, const Value &b) {
+                if (a.type != b.type) return false;
+                if (a.type == ValueType::NUMBER) return a.as.number == b.as.number;
+                if (a.type == ValueType::STRING) return a.as.object == b.as.object || a.asString() == b.asString();
+                return a.as.object == b.as.object;
+            }
+
+            // Index of the entry for `key`, or -1
+            int find (const Value &key) const {
+                if (this->slots.empty()) return -1;
+                size_t hash = MapObject::hash(key);
+                size_t mask = this->slots.size() - 1;
+                for (size_t i = hash & mask; this->slots[i] >= 0; i = (i + 1) & mask) {
+                    const Entry &entry = this->entries[this->slots[i]];
+                    if (entry.hash == hash && MapObject::equals(entry.key, key)) return this->slots[i];
+                }
+                return -1;
+            }
+
+            const Value *get (const Value &key) const {
+                int index = this->find(key);
+                return index < 0 ? nullptr : &this->entries[index].value;
+            }
+
+            // Adds an entry, or replaces the value of the existing one for `key`
+            void put (const Value &key, const Value &value) {
+                size_t hash = MapObject::hash(key);
+                if ((this->entries.size() + 1) * 2 > this->slots.size()) this->rehash(max((size_t)8, this->slots.size() * 2));
+                size_t mask = this->slots.size() - 1;
+                size_t i = hash & mask;
+                for (; this->slots[i] >= 0; i = (i + 1) & mask) {
+                    Entry &entry = this->entries[this->slots[i]];
+                    if (entry.hash == hash && MapObject::equals(entry.key, key)) {
+                        entry.value = value;
+                        return;
+                    }
+                }
+                this->slots[i] = this->entries.size();
+                this->entries.push_back(Entry { key, value, hash });
+            }
+
+            void reserve (size_t count) {
+                this->entries.reserve(count);
+                size_t capacity = 8;
+                while (capacity < count * 2) capacity *= 2;
+                if (capacity > this->slots.size()) this->rehash(capacity);
+            }
+
+            void rehash (size_t capacity) {
+                this->slots.assign(capacity, -1);
+                size_t mask = capacity - 1;
+                for (size_t e = 0; e < this->entries.size(); e++) {
+                    size_t i = this->entries[e].hash & mask;
+                    while (this->slots[i] >= 0) i = (i + 1) & mask;
+                    this->slots[i] = e;
+                }
+            }
+
+            // Bytes to account to the Heap for what the map holds
+            size_t getSize () const {
+                return sizeof(MapObject) + this->entries.capacity() * sizeof(Entry) + this->slots.size() * sizeof(int32_t);
+            }
+    };
+
+    inline ListObject *Value::asList () const { return static_cast<ListObject*>(this->as.object); }
+    inline MapObject *Value::asMap () const { return static_cast<MapObject*>(this->as.object); }
+
+    inline void Value::append (string &out, uint depth) const {
+        switch (this->type) {
+            case ValueType::NONE:
+            case ValueType::UNBOUND:  { out += "#none"; break; }
+            case ValueType::NUMBER:   { Value::appendNumber(out, this->as.number); break; }
+            case ValueType::STRING:   { out += this->asString(); break; }
+            case ValueType::SYMBOL:   { out += "#"; out += this->asString(); break; }
+            case ValueType::FUNCTION: { out += "@CALL "; break; }
+            case ValueType::ACTOR:    { out += "@ACTOR "; break; }
+            case ValueType::LIST: {
+                if (depth >= 16) {
+                    out += "[...]";
+                    break;
+                }
+                out += "[";
+                auto &items = this->asList()->items;
+                for (size_t i = 0; i < items.size(); i++) {
+                    if (i > 0) out += " ";
+                    items[i].append(out, depth + 1);
+                }
+                out += "]";
+                break;
+            }
+            case ValueType::MAP: {
+                if (depth >= 16) {
+                    out += "{...}";
+                    break;
+                }
+                out += "{";
+                auto &entries = this->asMap()->entries;
+                for (size_t i = 0; i < entries.size(); i++) {
+                    if (i > 0) out += ", ";
+                    entries[i].key.append(out, depth + 1);
+                    out += ": ";
+                    entries[i].value.append(out, depth + 1);
+                }
+                out += "}";
+                break;
+            }
+        }
+    }
+
+    // Already evaluated arguments of a native call or a handler; a view into the calling engine's value stack
+    struct Arguments {
+        const Value *items;
+        size_t count;
+
+        const Value *begin () const { return this->items; }
+        const Value *end () const { return this->items + this->count; }
+        const Value &operator[] (size_t index) const { return this->items[index]; }
+        const Value &back () const { return this->items[this->count - 1]; }
+        size_t size () const { return this->count; }
+        bool empty () const { return this->count == 0; }
+    };
+
+    static_assert(sizeof(Value) == 16, "Value should stay two words wide");
+}
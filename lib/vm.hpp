@@ -0,0 +1,483 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "parser.hpp"
+#include "value.hpp"
+#include "heap.hpp"
+#include "interpreter.hpp"
+#include "compiler.hpp"
+#include "resolver.hpp"
+#include "natives.hpp"
+#include "profiler.hpp"
+
+using namespace std;
+
+namespace Deluxe {
+    struct CallFrame {
+        uint function;
+        size_t ip;
+        size_t base;
+    };
+
+    // The function a CALL or TAIL_CALL instruction called last, so calling it again skips the type check and
+    // the prototype lookup. Valid while the VM's `version` is unchanged: a collection may reuse the object's
+    // memory, and linking may move the prototypes.
+    struct CallCache {
+        uint version;
+        const Object *callee;
+        const FunctionPrototype *function;
+        uint index;
+    };
+
+    class VM {
+        public:
+            Compiler compiler;
+            const Program *program;         // being run: the compiler's, or one shared with other VMs (see use)
+            shared_ptr<const Program> shared;   // keeps a shared `program` alive, if it needs to
+            Heap heap;
+            Natives natives;
+            NativeContext context;
+            vector<vector<Value>> constants;  // per function prototype
+            vector<Value> functions;
+            vector<Value> globals;
+            vector<Value> globalSymbols;
+            vector<Value> stack;
+            vector<CallFrame> frames;
+            vector<vector<CallCache>> callCaches;  // per function prototype, one per instruction
+            uint version;           // bumped whenever a cached call target may have gone stale
+            size_t cacheHits;
+            size_t cacheMisses;
+            Profiler *profiler;     // records calls when set
+            uint maxDepth;          // user calls in progress before a RuntimeException
+            size_t nextRelease;     // prototypes in use that make loading a form collect first
+
+            VM () : program(&compiler.program), natives(Natives::standard()), context(&heap, &cout) {
+                this->context.apply = [this](Value function, Arguments args) { return this->apply(function, args); };
+                this->profiler = nullptr;
+                this->maxDepth = 5000;
+                this->nextRelease = 64;
+                this->version = 1;
+                this->cacheHits = 0;
+                this->cacheMisses = 0;
+                for (auto name = this->natives.names.begin(); name != this->natives.names.end(); ++name) {
+                    this->compiler.registerNative(*name);
+                }
+            }
+
+            VM (ParseResult ast) : VM() {
+                this->load(ast);
+            }
+
+            // Compiles `ast` as the new top level and links it to the program.
+            // A stream of forms leaves behind the functions of finished forms that nothing refers to anymore, often
+            // along with too little garbage to start a collection, so enough new prototypes start one as well.
+            void load (ParseResult ast) {
+                if (this->program != &this->compiler.program) throw RuntimeException("Cannot add forms to a shared program");
+                if (this->program->functions.size() - this->compiler.released.size() >= this->nextRelease) this->collectGarbage(true);
+                Resolver::resolve(ast);
+                this->compiler.compileTopLevel(ast);
+                this->link();
+            }
+
+            // Runs a program compiled elsewhere, e.g. read back from a ProgramCache, in place of anything loaded so far
+            void load (const Program &program) {
+                this->compiler.program = program;
+                this->compiler.arena = program.functions[0].arena;
+                this->compiler.released.clear();
+                for (uint i = 1; i < program.functions.size(); i++) {
+                    if (program.functions[i].code.empty()) this->compiler.released.push_back(i);
+                }
+                this->use(this->compiler.program);
+            }
+
+            // Runs `program` in place of anything loaded so far without copying it, e.g. the program of a Script
+            // that isolates share, or that of the VM a fork works for. `owner` keeps it alive if needed; it must not
+            // change while this VM runs it, so nothing is released from it and no forms can be loaded on top.
+            void use (const Program &program, shared_ptr<const Program> owner = nullptr) {
+                this->program = &program;
+                this->shared = owner;
+                this->globals.clear();
+                this->globalSymbols.clear();
+                this->functions.clear();
+                this->constants.clear();
+                this->callCaches.clear();
+                this->link();
+            }
+
+            // Makes room for the symbols and prototypes added since the last link and links the top level, which
+            // may have been replaced. Other prototypes are linked when first called or closed over, so running a
+            // large program, e.g. in a new isolate, costs what it uses rather than what it contains.
+            void link () {
+                size_t symbols = this->program->symbols->size();
+                this->globals.resize(symbols, Value::unbound());
+                this->globalSymbols.resize(symbols, Value::unbound());
+                size_t count = this->program->functions.size();
+                this->functions.resize(count, Value::none());
+                this->constants.resize(count);
+                this->callCaches.resize(count);
+                this->callCaches[0].clear();
+                this->prepare(0);
+                this->version++;
+            }
+
+            // Creates the function value, constants and call caches of prototype `index` unless it has them already
+            void prepare (uint index) {
+                auto &caches = this->callCaches[index];
+                if (!caches.empty()) return;
+                auto &prototype = this->program->functions[index];
+                // Closures without captures are all alike, so each prototype gets one shared function value
+                if (!this->functions[index].isFunction()) this->functions[index] = Value::fromObject(this->heap.makeFunction(index));
+                auto &values = this->constants[index];
+                values.clear();
+                for (auto &constant : prototype.constants) values.push_back(this->heap.fromExpression(constant));
+                caches.assign(prototype.code.size(), CallCache { 0 });
+            }
+
+            // The symbol an unbound global evaluates to, made the first time it is needed
+            Value getGlobalSymbol (uint id) {
+                Value &symbol = this->globalSymbols[id];
+                if (!symbol.isBound()) symbol = this->heap.makeSymbol(this->program->symbols->name(id));
+                return symbol;
+            }
+
+            // Forgets every global binding, so the program can run again from a clean slate
+            void reset () {
+                fill(this->globals.begin(), this->globals.end(), Value::unbound());
+                this->stack.clear();
+                this->frames.clear();
+                this->version++;
+            }
+
+            Value execute (ParseResult form) {
+                this->load(form);
+                return this->run();
+            }
+
+            // Registers a host builtin; it is visible to code loaded afterwards
+            void define (const string &name, NativeFunction function, bool pure = false) {
+                uint id = this->natives.define(name, function, pure);
+                if (id == this->compiler.program.natives.size()) this->compiler.registerNative(name);
+            }
+
+            // Called only between instructions, where every live value is on the stack or in the tables below
+            void collectGarbage (bool force = false) {
+                if (!force && !this->heap.shouldCollect()) return;
+                this->heap.collect([&](Heap &heap) {
+                    heap.markAll(this->stack);
+                    heap.markAll(this->globals);
+                    heap.markAll(this->globalSymbols);
+                    // Prototypes are only released from the program this VM compiles
+                    if (this->program == &this->compiler.program) return this->markPrototypes(heap);
+                    heap.markAll(this->functions);
+                    for (auto &values : this->constants) heap.markAll(values);
+                });
+                this->version++;
+            }
+
+            // Keeps the prototypes still in use, with their function values and constants, and releases the others:
+            // the top level, those of running calls and of live function values, those actors hold, and every
+            // prototype a live one creates closures of. A released slot is reused for the next function compiled.
+            void markPrototypes (Heap &heap) {
+                heap.trace();
+                size_t count = this->program->functions.size();
+                vector<bool> live(count, false);
+                vector<uint> pending;
+                auto use = [&](uint index) {
+                    if (index >= count || live[index]) return;
+                    live[index] = true;
+                    pending.push_back(index);
+                };
+                use(0);
+                for (auto &frame : this->frames) use(frame.function);
+                heap.functions.each([&](FunctionObject *function) {
+                    if (function->marked) use(function->prototype);
+                });
+                if (this->context.scheduler != nullptr) {
+                    this->context.scheduler->eachFunction([&](const PortableFunction &function) { use(function.prototype); });
+                }
+                while (!pending.empty()) {
+                    uint index = pending.back();
+                    pending.pop_back();
+                    for (auto &ins : this->program->functions[index].code) {
+                        if (ins.op == OpCode::CLOSURE) use(ins.a);
+                    }
+                }
+                size_t kept = 0;
+                for (uint i = 0; i < count; i++) {
+                    if (live[i]) {
+                        heap.mark(this->functions[i]);
+                        heap.markAll(this->constants[i]);
+                        kept++;
+                    } else if (!this->program->functions[i].code.empty()) {
+                        // Also lets go of the arena of the form the function came from
+                        this->compiler.program.functions[i] = FunctionPrototype {};
+                        this->functions[i] = Value::none();
+                        vector<Value>().swap(this->constants[i]);
+                        vector<CallCache>().swap(this->callCaches[i]);
+                        this->compiler.released.push_back(i);
+                    }
+                }
+                this->nextRelease = max((size_t)64, kept * 2);
+            }
+
+            // Fills `cache` for a call of `callee`, which the instruction names `name`
+            void resolveCall (CallCache &cache, Value callee, const Value &name) {
+                this->cacheMisses++;
+                if (!callee.isFunction()) throw RuntimeException("Not a function: " + name.asString());
+                uint index = callee.asFunction()->prototype;
+                this->prepare(index);
+                cache = CallCache { this->version, callee.as.object, &this->program->functions[index], index };
+            }
+
+            Value pop () {
+                auto value = this->stack.back();
+                this->stack.pop_back();
+                return value;
+            }
+
+            Value run () {
+                // A previous run may have been abandoned by an exception
+                this->stack.clear();
+                this->frames.clear();
+                this->frames.push_back(CallFrame { 0, 0, 0 });
+                return this->start();
+            }
+
+            // Calls `function` from host code, e.g. as an actor's handler, while no script code runs
+            Value invoke (Value function, Arguments args) {
+                if (!function.isFunction()) throw RuntimeException("Not a function");
+                uint index = function.asFunction()->prototype;
+                this->prepare(index);
+                const FunctionPrototype &prototype = this->program->functions[index];
+                this->stack.clear();
+                this->frames.clear();
+                this->stack.push_back(function);
+                this->stack.insert(this->stack.end(), args.begin(), args.end());
+                this->stack.resize(1 + prototype.arity, Value::none());
+                this->stack.resize(1 + prototype.localCount, Value::unbound());
+                this->frames.push_back(CallFrame { index, 0, 1 });
+                return this->start();
+            }
+
+            // Calls `function` for a native, e.g. for-each, in the middle of the native's own call: a nested
+            // dispatch runs until the new frame returns. The stack may move, so `args` must not point into it.
+            Value apply (Value function, Arguments args) {
+                if (!function.isFunction()) throw RuntimeException("Not a function");
+                if (this->frames.size() > this->maxDepth) {
+                    throw RuntimeException("Maximum call depth of " + to_string(this->maxDepth) + " exceeded");
+                }
+                uint index = function.asFunction()->prototype;
+                this->prepare(index);
+                const FunctionPrototype &prototype = this->program->functions[index];
+                size_t calleeSlot = this->stack.size();
+                this->stack.push_back(function);
+                this->stack.insert(this->stack.end(), args.begin(), args.end());
+                this->stack.resize(calleeSlot + 1 + prototype.arity, Value::none());
+                this->stack.resize(calleeSlot + 1 + prototype.localCount, Value::unbound());
+                this->frames.push_back(CallFrame { index, 0, calleeSlot + 1 });
+                if (this->profiler != nullptr) this->profiler->enter(this->profiler->entry(false, prototype.name, prototype.line));
+                return this->start();
+            }
+
+            // A new VM for another thread, running this one's program on its own heap; the fork must be gone before
+            // this VM loads or releases anything. Globals are passed as portable copies, since this VM's heap may not
+            // be read concurrently.
+            unique_ptr<VM> fork (const vector<Portable> &globals) const {
+                auto engine = make_unique<VM>();
+                engine->natives = this->natives;
+                engine->context.scheduler = this->context.scheduler;
+                engine->heap.configure(this->heap.options);
+                engine->maxDepth = this->maxDepth;
+                engine->use(*this->program, this->shared);
+                for (size_t i = 0; i < globals.size() && i < engine->globals.size(); i++) {
+                    engine->globals[i] = globals[i].materialize(engine->heap);
+                }
+                return engine;
+            }
+
+            // Runs the frame on top of `frames` until it returns
+            Value start () {
+                this->collectGarbage();
+                if (this->profiler == nullptr) return this->dispatch<false>();
+                size_t depth = this->profiler->active.size();
+                try {
+                    return this->dispatch<true>();
+                } catch (...) {
+                    this->profiler->unwind(depth);
+                    throw;
+                }
+            }
+
+            // Instantiated twice so that running without a profiler carries no profiling code at all.
+            // Returns when the frame on top of `frames` on entry returns.
+            template<bool profiling>
+            Value dispatch () {
+                size_t floor = this->frames.size() - 1;
+                const CallFrame &entry = this->frames.back();
+                const Instruction *code = this->program->functions[entry.function].code.data();
+                const Value *constants = this->constants[entry.function].data();
+                // As on RETURN: a callee sits right below its frame's slots
+                const Value *captures = entry.base > 0 ? this->stack[entry.base - 1].asFunction()->captures.data() : nullptr;
+                CallCache *caches = this->callCaches[entry.function].data();
+                size_t ip = entry.ip;
+                size_t base = entry.base;
+
+                for (;;) {
+                    const Instruction &ins = code[ip++];
+                    switch (ins.op) {
+                        case OpCode::CONSTANT: {
+                            this->stack.push_back(constants[ins.a]);
+                            break;
+                        }
+                        case OpCode::NONE: {
+                            this->stack.push_back(Value::none());
+                            break;
+                        }
+                        case OpCode::LOAD_LOCAL: {
+                            this->stack.push_back(this->stack[base + ins.a]);
+                            break;
+                        }
+                        case OpCode::LOAD_CAPTURE: {
+                            this->stack.push_back(captures[ins.a]);
+                            break;
+                        }
+                        case OpCode::LOAD_GLOBAL: {
+                            const Value &value = this->globals[ins.a];
+                            this->stack.push_back(value.isBound() ? value : this->getGlobalSymbol(ins.a));
+                            break;
+                        }
+                        case OpCode::LOAD_CALLABLE: {
+                            if (!this->globals[ins.a].isBound()) throw RuntimeException("Undefined function " + this->program->symbols->name(ins.a));
+                            this->stack.push_back(this->globals[ins.a]);
+                            break;
+                        }
+                        case OpCode::DEFINE_LOCAL: {
+                            auto value = this->pop();
+                            if (!this->stack[base + ins.a].isBound()) this->stack[base + ins.a] = value;
+                            break;
+                        }
+                        case OpCode::DEFINE_GLOBAL: {
+                            auto value = this->pop();
+                            if (!this->globals[ins.a].isBound()) {
+                                this->globals[ins.a] = value;
+                                this->version++;
+                            }
+                            break;
+                        }
+                        case OpCode::CLOSURE: {
+                            if (ins.b == 0) {
+                                this->prepare(ins.a);
+                                this->stack.push_back(this->functions[ins.a]);
+                                break;
+                            }
+                            auto closure = this->heap.makeFunction(ins.a);
+                            closure->captures.assign(this->stack.end() - ins.b, this->stack.end());
+                            this->stack.resize(this->stack.size() - ins.b);
+                            this->stack.push_back(Value::fromObject(closure));
+                            break;
+                        }
+                        case OpCode::CALL_NATIVE: {
+                            // Arguments are passed in place on the stack
+                            size_t first = this->stack.size() - ins.b;
+                            this->context.calls++;
+                            this->context.site = &ins;
+                            if constexpr (profiling) {
+                                uint line = this->program->functions[this->frames.back().function].lines[ip - 1];
+                                this->profiler->enter(this->profiler->entry(true, this->natives.names[ins.a], line));
+                            }
+                            Value result = this->natives.functions[ins.a](this->context, Arguments { this->stack.data() + first, ins.b });
+                            if constexpr (profiling) this->profiler->exit();
+                            this->stack.resize(first);
+                            this->stack.push_back(result);
+                            break;
+                        }
+                        case OpCode::CALL: {
+                            size_t calleeSlot = this->stack.size() - ins.b - 1;
+                            Value callee = this->stack[calleeSlot];
+                            CallCache &cache = caches[ip - 1];
+                            if (callee.isFunction() && cache.callee == callee.as.object && cache.version == this->version) this->cacheHits++;
+                            else this->resolveCall(cache, callee, constants[ins.a]);
+                            if (this->frames.size() > this->maxDepth) {
+                                uint line = this->program->functions[this->frames.back().function].lines[ip - 1];
+                                throw RuntimeException("Maximum call depth of " + to_string(this->maxDepth) + " exceeded", line);
+                            }
+                            uint index = cache.index;
+                            const FunctionPrototype &function = *cache.function;
+                            // Missing arguments are none, surplus arguments are dropped, `let` slots start unbound
+                            this->stack.resize(calleeSlot + 1 + function.arity, Value::none());
+                            this->stack.resize(calleeSlot + 1 + function.localCount, Value::unbound());
+                            this->frames.back().ip = ip;
+                            this->frames.push_back(CallFrame { index, 0, calleeSlot + 1 });
+                            if constexpr (profiling) {
+                                this->profiler->enter(this->profiler->entry(false, constants[ins.a].asString(), function.line));
+                            }
+                            this->collectGarbage();
+                            code = function.code.data();
+                            constants = this->constants[index].data();
+                            caches = this->callCaches[index].data();
+                            captures = callee.asFunction()->captures.data();
+                            ip = 0;
+                            base = calleeSlot + 1;
+                            break;
+                        }
+                        case OpCode::TAIL_CALL: {
+                            size_t calleeSlot = this->stack.size() - ins.b - 1;
+                            Value callee = this->stack[calleeSlot];
+                            CallCache &cache = caches[ip - 1];
+                            if (callee.isFunction() && cache.callee == callee.as.object && cache.version == this->version) this->cacheHits++;
+                            else this->resolveCall(cache, callee, constants[ins.a]);
+                            uint index = cache.index;
+                            const FunctionPrototype &function = *cache.function;
+                            // Callee and arguments slide down over the current frame, which the callee takes over
+                            std::copy(this->stack.begin() + calleeSlot, this->stack.end(), this->stack.begin() + base - 1);
+                            this->stack.resize(base + ins.b);
+                            this->stack.resize(base + function.arity, Value::none());
+                            this->stack.resize(base + function.localCount, Value::unbound());
+                            this->frames.back() = CallFrame { index, 0, base };
+                            if constexpr (profiling) {
+                                this->profiler->exit();
+                                this->profiler->enter(this->profiler->entry(false, constants[ins.a].asString(), function.line));
+                            }
+                            this->collectGarbage();
+                            code = function.code.data();
+                            constants = this->constants[index].data();
+                            caches = this->callCaches[index].data();
+                            captures = callee.asFunction()->captures.data();
+                            ip = 0;
+                            break;
+                        }
+                        case OpCode::POP: {
+                            this->stack.pop_back();
+                            break;
+                        }
+                        case OpCode::RETURN: {
+                            auto result = this->pop();
+                            if constexpr (profiling) {
+                                if (this->frames.size() > 1) this->profiler->exit();
+                            }
+                            this->frames.pop_back();
+                            if (this->frames.size() == floor) {
+                                this->stack.resize(base > 0 ? base - 1 : 0);
+                                return result;
+                            }
+                            this->stack.resize(base - 1);
+                            this->stack.push_back(result);
+                            auto &frame = this->frames.back();
+                            code = this->program->functions[frame.function].code.data();
+                            constants = this->constants[frame.function].data();
+                            caches = this->callCaches[frame.function].data();
+                            ip = frame.ip;
+                            base = frame.base;
+                            // The callee sits right below the frame's slots
+                            captures = base > 0 ? this->stack[base - 1].asFunction()->captures.data() : nullptr;
+                            break;
+                        }
+                    }
+                }
+            }
+    };
+}
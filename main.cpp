@@ -2,17 +2,28 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <sstream>
+#include <fstream>
 
 #include <ctype.h>
 
+#include "lib/allocations.hpp"
 #include "lib/textfile.hpp"
 #include "lib/parser.hpp"
 #include "lib/interpreter.hpp"
+#include "lib/vm.hpp"
+#include "lib/stream.hpp"
+#include "lib/profiler.hpp"
+#include "lib/cache.hpp"
+#include "lib/optimizer.hpp"
+#include "lib/output.hpp"
+#include "lib/actors.hpp"
+#include "lib/loader.hpp"
 
 using namespace std;
 
-void show (vector<Deluxe::Expression> ast, string prefix) {
-    for(std::vector<Deluxe::Expression>::iterator it = std::begin(ast); it != std::end(ast); ++it) {
+void show (Deluxe::ExpressionList ast, string prefix) {
+    for(auto it = std::begin(ast); it != std::end(ast); ++it) {
         if (it->tag == Deluxe::ExpressionTag::CALL) {
             cout << prefix << "CALL " << it->callName << " {" << endl;
             show(it->callValue, prefix + "  ");
@@ -32,34 +43,301 @@ void show (vector<Deluxe::Expression> ast, string prefix) {
     }
 }
 
-int main() {
-    unique_ptr<Deluxe::Textfile> file = std::make_unique<Deluxe::Textfile>(std::cin >> std::noskipws);
-    // cout << "What: " << file->getContents() << endl;
-    string content(file->getContents());
+bool statistics = false;
+Deluxe::HeapOptions heapOptions;
+uint maxDepth = 5000;
+unique_ptr<Deluxe::Profiler> profiler;
+string foldedPath;
+bool optimizing = true;
+Deluxe::Optimizer optimizer;
+uint threads = 0;
 
+// Rewrites a parsed program, or one streamed form, before an engine sees it
+void optimize (Deluxe::ParseResult &ast) {
+    if (optimizing) optimizer.optimize(ast);
+}
+
+// --stats goes to stderr so it never mixes with program output
+template<typename Engine>
+void report (size_t allocations, const Engine &engine, const Deluxe::Scheduler &scheduler) {
+    if (!statistics) return;
+    cout.flush();
+    if (Deluxe::Allocations::enabled) cerr << "allocations: " << allocations << endl;
+    else cerr << "allocations: not counted in this build (make stats)" << endl;
+    cerr << "native calls: " << engine.context.calls << endl;
+    cerr << "call site cache: " << engine.cacheHits << " hits, " << engine.cacheMisses << " misses" << endl;
+    if (optimizing) {
+        cerr << "optimizer: " << optimizer.stats.folded << " folded, " << optimizer.stats.inlined << " inlined, "
+             << optimizer.stats.removed << " removed" << endl;
+    }
+    if (scheduler.stats.actors > 0) {
+        cerr << "actors: " << scheduler.stats.actors << ", messages: " << scheduler.stats.messages << ", steals: "
+             << scheduler.stats.steals << ", threads: " << scheduler.stats.threads << endl;
+    }
+    auto &heap = engine.heap;
+    cerr << "gc collections: " << heap.stats.collections << endl;
+    cerr << "gc pause: " << heap.stats.totalPause << " ms total, " << heap.stats.maxPause << " ms max" << endl;
+    cerr << "heap allocated: " << heap.stats.bytesAllocated << " bytes, freed: " << heap.stats.bytesFreed << " bytes" << endl;
+    cerr << "heap live: " << heap.stats.liveBytes << " bytes, peak: " << heap.stats.peakBytes << " bytes, reserved: " << heap.getCapacity() << " bytes" << endl;
+}
+
+// Flat profile on stderr; folded stacks for flamegraph tools go to the file given with --profile=
+int writeProfile (int status) {
+    if (profiler == nullptr) return status;
+    cout.flush();
+    profiler->report(cerr);
+    if (foldedPath.empty()) return status;
+    ofstream folded(foldedPath);
+    if (!folded) {
+        cerr << "Error: Cannot write " << foldedPath << endl;
+        return 1;
+    }
+    profiler->writeFolded(folded);
+    return status;
+}
+
+// Applies the command-line settings to a new engine
+template<typename Engine>
+void configure (Engine &engine) {
+    engine.profiler = profiler.get();
+    engine.heap.configure(heapOptions);
+    engine.maxDepth = maxDepth;
+}
+
+// Runs the top level, then delivers the messages it sent to actors
+template<typename Engine>
+void run (Engine &engine) {
+    Deluxe::Scheduler scheduler(threads);
+    engine.context.scheduler = &scheduler;
+    size_t allocations = Deluxe::Allocations::count();
+    engine.run();
+    scheduler.run(engine);
+    report(Deluxe::Allocations::count() - allocations, engine, scheduler);
+}
+
+void interpret (Deluxe::ParseResult &ast) {
+    auto interpreter = Deluxe::Interpreter(ast);
+    configure(interpreter);
+    run(interpreter);
+}
+
+void execute (Deluxe::ParseResult &ast) {
+    auto vm = Deluxe::VM(ast);
+    configure(vm);
+    run(vm);
+}
+
+// Runs the VM from the script's .dlxc cache; a missing or stale cache is rebuilt from the source first
+void executeCached (const string &path, shared_ptr<Deluxe::Textfile> file) {
+    Deluxe::VM vm;
+    configure(vm);
+    Deluxe::Program program;
+    string cachePath = Deluxe::ProgramCache::getPath(path);
+    bool cached = false;
     try {
-        auto tokens = Deluxe::Parser::getTokens(content);
+        cached = Deluxe::ProgramCache::load(cachePath, file->getView(), vm.natives.names, program, optimizing);
+    } catch (Deluxe::CacheException& e) {
+        cerr << "Warning: " << e.what() << endl;
+    }
+    if (cached) {
+        vm.load(program);
+    } else {
+        auto ast = Deluxe::Parser::parse(Deluxe::Parser::getTokens(file->getView()), file);
+        optimize(ast);
+        vm.load(ast);
+        Deluxe::ProgramCache::save(cachePath, *vm.program, file->getView(), optimizing);
+    }
+    run(vm);
+}
 
-        // cout << "Tokens: " << tokens.size() << endl;
+// Runs one engine with stdout captured, errors included, so engines can be compared
+string capture (void (*engine)(Deluxe::ParseResult&), Deluxe::ParseResult &ast) {
+    stringstream output;
+    auto original = cout.rdbuf(output.rdbuf());
+    try {
+        engine(ast);
+    } catch (exception& e) {
+        cout << "Error: " << e.what() << endl;
+    }
+    cout.rdbuf(original);
+    return output.str();
+}
 
-        // for (int i = 0; i < tokens.size(); i++) {
-        //     cout << "Token: " << Deluxe::Parser::getTokenName(tokens[i].tokenType) << " -> " << tokens[i].content << endl;
-        // }
+int compare (Deluxe::ParseResult &ast) {
+    string expected = capture(interpret, ast);
+    string actual = capture(execute, ast);
+    cout << actual;
+    if (expected == actual) return 0;
 
-        uint len = 0;
-        auto ast = Deluxe::Parser::parse(tokens);
+    stringstream expectedLines(expected);
+    stringstream actualLines(actual);
+    string expectedLine, actualLine;
+    uint line = 1;
+    while (true) {
+        bool hasExpected = (bool)std::getline(expectedLines, expectedLine);
+        bool hasActual = (bool)std::getline(actualLines, actualLine);
+        if (!hasExpected) expectedLine = "<end of output>";
+        if (!hasActual) actualLine = "<end of output>";
+        if (expectedLine != actualLine) break;
+        line++;
+    }
+    // The report must not overtake the buffered output before it
+    cout.flush();
+    cerr << "Engine mismatch at output line " << line << ":" << endl;
+    cerr << "  interpreter: " << expectedLine << endl;
+    cerr << "  vm:          " << actualLine << endl;
+    return 1;
+}
 
-        // show(ast.expressions, "");
-        auto interpreter = Deluxe::Interpreter(ast);
+// Executes every top-level form as soon as its closing bracket has been read
+template<typename Engine>
+void stream (Engine &engine, Deluxe::FormReader &reader, int fd, Deluxe::Scheduler &scheduler) {
+    char buffer[64 * 1024];
+    bool done = false;
+    while (!done) {
+        // Results of the forms so far should be out before waiting for more input
+        cout.flush();
+        ssize_t count = ::read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) done = true;
+        else reader.feed(string_view(buffer, count));
+        while (true) {
+            Deluxe::ParseResult form;
+            try {
+                if (!(done ? reader.finish(form) : reader.next(form))) break;
+                optimize(form);
+                engine.execute(form);
+                scheduler.run(engine);
+            } catch (exception& e) {
+                cout << "Error: " << e.what() << endl;
+            }
+        }
+    }
+}
 
-        for(std::vector<Deluxe::Expression>::iterator it = std::begin(ast.expressions); it != std::end(ast.expressions); ++it) {
-            interpreter.executeExpression(*it);
+int stream (const string &engine, const string &path) {
+    int fd = path.empty() ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cout << "Error: Cannot open " << path << endl;
+        return 1;
+    }
+    Deluxe::FormReader reader;
+    Deluxe::Scheduler scheduler(threads);
+    size_t allocations = Deluxe::Allocations::count();
+    if (engine == "interpreter") {
+        Deluxe::Interpreter interpreter(reader.symbols);
+        configure(interpreter);
+        interpreter.context.scheduler = &scheduler;
+        stream(interpreter, reader, fd, scheduler);
+        report(Deluxe::Allocations::count() - allocations, interpreter, scheduler);
+    } else {
+        Deluxe::VM vm;
+        configure(vm);
+        vm.context.scheduler = &scheduler;
+        stream(vm, reader, fd, scheduler);
+        report(Deluxe::Allocations::count() - allocations, vm, scheduler);
+    }
+    if (fd != STDIN_FILENO) ::close(fd);
+    return 0;
+}
+
+// Numeric option values; false unless all of `text` is a number
+bool parseOption (const string &text, double &value) {
+    char *end = nullptr;
+    value = strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+}
+
+int main(int argc, char **argv) {
+    // Program output is written in large blocks; the buffer is flushed when main returns
+    Deluxe::OutputBuffer output(cout, STDOUT_FILENO);
+    string engine("vm");
+    vector<string> paths;
+    bool streaming = false;
+    bool caching = false;
+    bool dumping = false;
+    double number = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg == "--vm") engine = "vm";
+        else if (arg == "--interpreter") engine = "interpreter";
+        else if (arg == "--compare") engine = "compare";
+        else if (arg == "--stream") streaming = true;
+        else if (arg == "--stats") statistics = true;
+        else if (arg == "--cache") caching = true;
+        else if (arg == "--no-optimize") optimizing = false;
+        else if (arg == "--dump-ast") dumping = true;
+        else if (arg == "--no-gc") heapOptions.enabled = false;
+        else if (arg.rfind("--threads=", 0) == 0 && parseOption(arg.substr(10), number) && number >= 1) threads = number;
+        else if (arg.rfind("--max-depth=", 0) == 0 && parseOption(arg.substr(12), number) && number >= 1) maxDepth = number;
+        else if (arg.rfind("--gc-threshold=", 0) == 0 && parseOption(arg.substr(15), number) && number >= 0) heapOptions.threshold = number;
+        else if (arg.rfind("--gc-growth=", 0) == 0 && parseOption(arg.substr(12), number) && number >= 1) heapOptions.growth = number;
+        else if (arg == "--profile" || arg.rfind("--profile=", 0) == 0) {
+            profiler = make_unique<Deluxe::Profiler>();
+            if (arg.size() > 10) foldedPath = arg.substr(10);
+        }
+        else if (arg[0] != '-') paths.push_back(arg);
+        else {
+            cerr << "Usage: deluxe [--vm | --interpreter | --compare] [--stream] [--cache] [--stats] [--profile[=folded file]]" << endl
+                 << "              [--no-optimize] [--dump-ast] [--threads=count] [--max-depth=calls] [--no-gc]" << endl
+                 << "              [--gc-threshold=bytes] [--gc-growth=factor] [program files...]" << endl;
+            return 2;
         }
+    }
+    string path = paths.empty() ? "" : paths[0];
+    if ((streaming || caching) && paths.size() > 1) {
+        cerr << (streaming ? "--stream" : "--cache") << " runs a single program file" << endl;
+        return 2;
+    }
+    if ((streaming || profiler) && engine == "compare") {
+        cerr << (streaming ? "--stream" : "--profile") << " runs a single engine" << endl;
+        return 2;
+    }
+    if (dumping && (streaming || caching)) {
+        cerr << "--dump-ast prints a whole program without running it" << endl;
+        return 2;
+    }
+    if (caching && (engine != "vm" || streaming || path.empty())) {
+        cerr << "--cache needs a program file run by the vm" << endl;
+        return 2;
+    }
+    if (streaming) return writeProfile(stream(engine, path));
+
+    try {
+        Deluxe::ParseResult ast;
+        if (paths.size() > 1) {
+            // Files are parsed in parallel and run one after another, in the order given
+            ast = Deluxe::Loader::load(paths, threads);
+        } else {
+            // Files are memory-mapped; stdin is read in one bulk pass
+            shared_ptr<Deluxe::Textfile> file = path.empty()
+                ? std::make_shared<Deluxe::Textfile>(std::cin)
+                : Deluxe::Textfile::open(path);
+            if (caching) {
+                executeCached(path, file);
+                return writeProfile(0);
+            }
+
+            ast = Deluxe::Parser::parse(Deluxe::Parser::getTokens(file->getView()), file);
+        }
+
+        optimize(ast);
+        if (dumping) {
+            show(ast.expressions, "");
+            return 0;
+        }
+        // Actors running on one thread handle their messages in the same order in both engines
+        if (engine == "compare") {
+            threads = 1;
+            return compare(ast);
+        }
+        if (engine == "interpreter") interpret(ast);
+        else execute(ast);
 
     } catch (exception& e) {
         cout << "Error: " << e.what() << endl;
     }
 
 
-    return 0;
-}
\ No newline at end of file
+    return writeProfile(0);
+};